@@ -16,24 +16,64 @@
  * along with this program.  If not, see <https://www.gnu.org/licenses/>
  */
 
+#ifdef __linux__
+#include <linux/netlink.h>
+#include <sys/prctl.h>
+#endif
+
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/un.h>
+#include <sys/wait.h>
 
+#include <dirent.h>
 #include <err.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <getopt.h>
+#include <limits.h>
+#include <poll.h>
 #include <signal.h>
 #include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <X11/Xatom.h>
 #include <X11/Xlib.h>
 #include <X11/Xutil.h>
+#include <X11/extensions/dpms.h>
+
+#ifdef USE_DAMAGE
+#include <X11/extensions/Xdamage.h>
+#endif
+
+#ifdef USE_RANDR
+#include <X11/extensions/Xrandr.h>
+#endif
+
+#ifdef USE_SCRNSAVER
+#include <X11/extensions/scrnsaver.h>
+#endif
 
+#ifdef USE_NATIVE_IMAGES
+#include <zlib.h>
+#else
 #include <Imlib2.h>
+#endif
+
+#ifdef USE_SVG
+#include <librsvg/rsvg.h>
+#include <pthread.h>
+#endif
 
 #ifndef DEFAULT_BG_PATH
 #define DEFAULT_BG_PATH "tile-default.png"
@@ -49,36 +89,315 @@ struct position {
     int y;
 };
 
+#ifdef USE_NATIVE_IMAGES
+struct image {
+    unsigned width;
+    unsigned height;
+    uint32_t *pixels; // ARGB, not premultiplied
+};
+
+typedef struct image *image_t;
+
+#define IMAGE_MAX_SIZE 16384
+#else
+typedef Imlib_Image image_t;
+#endif
+
+#ifdef USE_SVG
+// Workers only fill in the results, errors are reported by the main thread
+struct svg_job {
+    int cache_failed;
+    char cache_path[PATH_MAX];
+    char error[256];
+    image_t *image;
+    struct svg_job *next;
+    int notify_fd;
+    const char *path;
+    uint32_t *pixels; // ARGB result, NULL if rasterizing failed
+    unsigned size;
+};
+#endif
+
 #define TILE_TYPE_APP 0
 #define TILE_TYPE_LAUNCHER 1
+#define TILE_TYPE_TASKS 2
+
+// Longest _NET_WM_ICON read in 32-bit items, enough for icons up to 256x256
+#define TASK_ICON_MAX_ITEMS (1 << 18)
+
+#define SWALLOW_IDLE 0
+#define SWALLOW_ICON 1
+#define SWALLOW_UNMAPPED 2
+#define SWALLOW_REPARENTED 3
+
+#define SWALLOW_ICON_ATTEMPTS 2
+
+#define GRAVITY_EAST 0x01
+#define GRAVITY_SOUTH 0x02
+
+struct rect {
+    int x;
+    int y;
+    unsigned width;
+    unsigned height;
+};
+
+#define TIMER_PLACEHOLDER 0
+#define TIMER_BADGE 1
+#define TIMER_STARTUP 2
+#define TIMER_PRESSURE 3
+#define TIMER_DPMS 4
+#define TIMER_LAUNCH 5
+#define TIMER_SWALLOW 6
+#define TIMER_HUD 7
+#define TIMER_COUNT 8
+
+#define LAUNCH_TIMEOUT_MS 30000
+
+// Launch latency histogram buckets are powers of two in milliseconds
+#define LATENCY_BUCKETS 17
+
+#define STARTUP_TIMEOUT_MS 5000
+#define STARTUP_MAX_WAIT_MS 30000
+
+#define WATCH_DISPLAY 0
+#define WATCH_CONTROL 1
+#define WATCH_PRESSURE 2
+#define WATCH_POWER 3
+#define WATCH_SVG 4
+#define WATCH_CHILD 5
+#define WATCH_COUNT 6
+
+// Notify when tasks stall on memory for 150ms within a 2s window
+#define PRESSURE_TRIGGER "some 150000 2000000"
+#define PRESSURE_RELIEF_MS 10000
+
+// DPMS has no events, its state is polled, backing off while it doesn't change
+#define DPMS_CHECK_MIN_MS 2000
+#define DPMS_CHECK_MAX_MS 30000
+
+#define GLYPH_FIRST 0x20
+#define GLYPH_LAST 0x7e
+
+#define PLACEHOLDER_INTERVAL_MS 300
+#define PLACEHOLDER_DOTS 3
+
+#define BADGE_MAX_LEN 8
+#define BADGE_PADDING 1
+
+// Parts of a tile to repaint at the end of the current event batch
+#define DIRTY_TILE 0x01
+#define DIRTY_BADGE 0x02
+#define DIRTY_PLACEHOLDER 0x04
+#define DIRTY_HUD 0x08
+
+// Stack touched before locking memory, so deep call chains don't fault
+#define PREFAULT_STACK_SIZE (64 * 1024)
+
+#define HUD_INTERVAL_MS 1000
+#define HUD_LINES 3
+
+// Counters shown by the debug overlay, rates cover the last refresh interval
+struct tile_stats {
+    unsigned long long bytes;
+    unsigned cpu_percent;
+    unsigned long long cpu_ticks;
+#ifdef USE_DAMAGE
+    Damage damage;
+#endif
+    unsigned damage_count;
+    unsigned damage_rate;
+    unsigned long exposes;
+    unsigned hud_width;
+    long long repaint_avg_us;
+    unsigned repaint_count;
+    long long repaint_us;
+};
+
+#define FNV_OFFSET 0xcbf29ce484222325ULL
+#define FNV_PRIME 0x100000001b3ULL
+
+// A composed tile pixmap shared by all tiles showing the same art
+struct shared_pixmap {
+    uint64_t hash;
+    struct shared_pixmap *next;
+    Pixmap pixmap;
+    unsigned refs;
+};
 
 struct tile {
+    char badge[BADGE_MAX_LEN + 1];
+    int badge_dirty;
+    struct rect badge_rect;
     const char *command;
-    Imlib_Image icon;
+    unsigned dirty;
+    image_t icon;
+    const char *icon_path;
+    pid_t launch_pid;
+    long long launched_at;
+    unsigned latency_hist[LATENCY_BUCKETS];
+    long long latency_total_ms;
     pid_t pid;
+    Pixmap pixmap;
+    int priority;
     const char *res_name;
+    long long started_at;
+    struct tile_stats stats;
+    int swallow_attempts;
+    long long swallow_at;
+    Window swallow_icon;
+    struct position swallow_icon_pos;
+    Window swallow_main;
+    struct position swallow_main_pos;
+    unsigned swallow_stage;
+    int swallow_wm;
     unsigned type;
     Window window;
 };
 
+// A running client shown in the tasks tile group
+struct task {
+    Window client;
+    int dirty;
+    Pixmap pixmap;
+    int skipped; // started skipping the taskbar, dropped on the next update
+    unsigned slot;
+    Window window;
+};
+
+#define FREEZE_HIDDEN 0x01
+#define FREEZE_IDLE 0x02
+#define FREEZE_DPMS 0x04
+#define FREEZE_FULLSCREEN 0x08
+
+#define PROFILE_AC 0
+#define PROFILE_BATTERY 1
+
+struct profile {
+    const char *name;
+    int animations;
+    unsigned badge_interval_ms;
+    int freeze_hidden;
+    unsigned sample_interval_ms;
+    unsigned long timer_slack_ns;
+};
+
+#define ATOM_MOTIF_WM_HINTS 0
+#define ATOM_NET_ACTIVE_WINDOW 1
+#define ATOM_NET_CLIENT_LIST 2
+#define ATOM_NET_CLIENT_LIST_STACKING 3
+#define ATOM_NET_SUPPORTING_WM_CHECK 4
+#define ATOM_NET_WM_DESKTOP 5
+#define ATOM_NET_WM_ICON 6
+#define ATOM_NET_WM_PID 7
+#define ATOM_NET_WM_STATE 8
+#define ATOM_NET_WM_STATE_ABOVE 9
+#define ATOM_NET_WM_STATE_FULLSCREEN 10
+#define ATOM_NET_WM_STATE_SKIP_TASKBAR 11
+#define ATOM_COUNT 12
+
+struct glyph_cache {
+    Pixmap atlas;
+    unsigned ascent;
+    unsigned glyph_width;
+    unsigned glyph_height;
+    unsigned long bg_pixel;
+};
+
+// X and process calls made by the swallow, startup and reaping logic, and
+// the clock. tools/swallowsim.c replaces them to drive that logic against
+// a simulated X server, window manager and dockapps.
+struct platform {
+    int (*bypass_window_manager)(Window);
+    int (*check_window_manager)(void);
+    Window (*get_icon_window)(Window);
+    long long (*get_time_us)(void);
+    struct size (*get_window_size)(Window);
+    void (*map_window)(Window);
+    void (*reparent_window)(Window, struct position);
+    void (*select_root_events)(long);
+    void (*set_border_width)(Window, unsigned);
+    int (*signal_process)(pid_t, int);
+    pid_t (*spawn_process)(const char *);
+    void (*unmap_window)(Window);
+    pid_t (*wait_child)(int *);
+};
+
 struct app {
     int above_all;
+    Window active_window;
     int all_desktops;
-    Imlib_Image bg_image;
+    Atom atoms[ATOM_COUNT];
+    long long badge_painted_at;
+    image_t bg_image;
+    const char *bg_path;
+    uint32_t *bg_pixels; // composed background, only kept by the built-in renderer
+    Pixmap bg_pixmap;
+    unsigned child_count;
+    volatile sig_atomic_t child_exited;
+    int child_pipe[2];
+    unsigned long client_count;
+    Window *client_list;
+    const char *control_path;
     int daemon_mode;
+    int damage_event_base;
     Display *display;
+    int dock_hidden;
+    struct position dock_pos; // last requested, queried often and costly to compute
     Window dock_window;
+    int dpms_capable;
+    unsigned dpms_check_ms;
+    int early_daemon;
+    unsigned freeze_reasons;
+    int fullscreen_yield;
+    GC gc;
+    struct glyph_cache glyphs;
+    unsigned gravity;
     int horizontal;
+    int hud;
+    GC hud_gc;
+    long long hud_refreshed_at;
+    int idle_freeze;
+    int image_cache_size;
+    int inherited_nice;
     int initial_x;
     int initial_y;
+    long long last_launch_at;
+    int lock_memory;
+    double max_cpu_pressure;
+    unsigned max_jobs;
+    double max_load;
     unsigned long mwm_decor;
     unsigned long mwm_funcs;
+    int nice_level;
+    const char *output_name;
+    int override_redirect;
+    pid_t parent_pid;
+    struct shared_pixmap *pixmaps;
+    unsigned placeholder_frame;
+    const struct platform *platform;
+    int power_profiles;
+    const struct profile *profile;
+    int randr_event_base;
     Window root_window;
+    int saver_event_base;
     int screen;
+    long long started_at;
+#ifdef USE_SVG
+    struct svg_job *svg_failed;
+    struct svg_job *svg_jobs;
+    int svg_pipe[2];
+#endif
+    struct task *tasks;
+    unsigned task_count;
+    int task_tile;
     struct tile *tiles;
     unsigned tile_count;
     unsigned tile_size;
+    long long timers[TIMER_COUNT];
+    int timer_slack_warned;
     int verbose;
+    struct pollfd watches[WATCH_COUNT];
 };
 
 static void pm_fprintf(FILE *, const char *, const char *, va_list);
@@ -87,31 +406,184 @@ static void pm_warn(const char *, ...);
 static void pm_error(const char *, ...);
 static void pm_assert(int, const char *, ...);
 static void exit_usage(int);
+static long long read_monotonic_us(void);
+static long long get_time_ms(void);
+static long long get_time_us(void);
+static uint64_t hash_bytes(uint64_t, const void *, size_t);
+static uint64_t hash_file(const char *);
+static void set_timer(unsigned, long long);
+static void cancel_timer(unsigned);
+static int check_timer_paused(unsigned);
+static int get_poll_timeout(void);
+static void run_timers(void);
 static int check_window_manager(void);
+static int bypass_window_manager(Window);
 static Window get_icon_window(Window);
-static Window get_icon_window_waiting(Window);
 static struct size get_window_size(Window);
+static void map_window(Window);
+static void reparent_window(Window, struct position);
+static void select_root_events(long);
+static void set_border_width(Window, unsigned);
+static void unmap_window(Window);
+static unsigned char *get_window_property(Window, Atom, Atom, unsigned long, unsigned long *);
+static void setup_images(void);
+static image_t image_load(const char *);
+static void image_free(image_t);
+static struct size image_get_size(image_t);
+static void image_render(image_t, Drawable, int, int, unsigned, unsigned);
+static void image_set_cache(int);
+#ifdef USE_NATIVE_IMAGES
+static unsigned char *read_file(const char *, size_t *);
+static image_t image_create(unsigned, unsigned);
+static uint32_t read_be32(const unsigned char *);
+static unsigned png_paeth(int, int, int);
+static int check_png_depth(unsigned, unsigned);
+static image_t decode_png(const unsigned char *, size_t);
+static image_t decode_farbfeld(const unsigned char *, size_t);
+static int parse_xpm_color(const char *, uint32_t *);
+static image_t decode_xpm(const char *, size_t);
+static uint32_t *scale_pixels(image_t, unsigned, unsigned);
+#endif
+static image_t image_from_pixels(unsigned, unsigned, const uint32_t *);
+#ifdef USE_SVG
+static int check_svg_path(const char *);
+static void get_svg_cache_path(const char *, unsigned, char *, size_t);
+static int write_farbfeld(const char *, const uint32_t *, unsigned, unsigned);
+static void *rasterize_svg(void *);
+static void start_svg_job(image_t *, const char *, const char *);
+static int check_svg_pending(const image_t *);
+static void handle_svg_done(int);
+#endif
+static image_t load_image(image_t *, const char *);
+static void free_image(image_t *);
+static void render_image_centered(image_t, Drawable);
 static void set_wm_class_hint(Window, const char *, const char *);
 static void set_mwm_hints(Window, unsigned long, unsigned long, unsigned long);
 static void set_wm_desktop_hint(Window, int32_t);
 static void set_wm_above_hint(Window);
+static struct position get_slot_position(unsigned);
+static unsigned get_tile_slot(unsigned);
 static struct position get_tile_position(unsigned);
+static struct size get_dock_size(void);
+static struct rect get_output_rect(void);
+static struct position get_dock_position(void);
+static void move_dock_window(void);
 static int check_all_dockapps_swallowed(void);
+static void notify_parent(void);
+static void draw_placeholder(unsigned);
+static void handle_placeholder_timer(void);
+static void create_glyph_cache(void);
+static int check_glyph_cache(void);
+static void set_badge(unsigned, const char *);
+static void paint_badge(unsigned);
+static void handle_badge_timer(void);
+static void count_tile_bytes(unsigned, unsigned, unsigned);
+static unsigned long long read_cpu_ticks(pid_t);
+static void update_tile_stats(unsigned, long long);
+static void paint_hud(unsigned);
+static void handle_hud_timer(void);
+#ifdef USE_DAMAGE
+static void handle_damage_event(XEvent *);
+#endif
+static void handle_control_command(char *, FILE *);
+static void handle_control_socket(int);
+static void handle_memory_pressure(int);
+static void handle_pressure_relief_timer(void);
+static void set_frozen(unsigned, int);
+static void set_dock_hidden(int);
+static void set_timer_slack(pid_t, unsigned long);
+static void apply_profile(const struct profile *);
+static int check_on_battery(void);
+static void handle_power_event(int);
+#ifdef USE_SCRNSAVER
+static void handle_screen_saver_event(const XEvent *);
+#endif
+static void set_dpms_off(int);
+static void handle_dpms_timer(void);
+static int check_own_window(Window);
+static int check_window_state(Window, Atom);
+static int check_fullscreen_covering(void);
+static void update_active_window(void);
+static void handle_property_event(const XEvent *);
+static int check_task_client(Window);
+static void update_task_state(Window);
+static int check_launch_pending(void);
+static void update_client_list(int);
+static pid_t get_parent_pid(pid_t);
+static void record_launch_latency(unsigned);
+static void check_launched_window(Window);
+static void handle_launch_timer(void);
+static void print_launch_stats(FILE *);
+static void schedule_swallow(unsigned, unsigned, long long);
+static int find_dockapp_tile(const char *);
 static void swallow_dockapp(Window, int);
+static void advance_swallow(unsigned);
+static void finish_swallow(unsigned);
+static void handle_swallow_timer(void);
 static void handle_sigusr1(int);
+static void handle_sigchld(int);
 static void handle_sigterm(int);
+static void create_child_pipe(void);
+static void handle_child_signal(int);
+static void handle_child_pipe(int);
+static void reap_children(void);
+static int signal_process(pid_t, int);
+static pid_t spawn_process(const char *);
+static pid_t wait_child(int *);
+static unsigned count_open_fds(void);
+static void print_footprint(FILE *);
+static unsigned long read_locked_kib(void);
+static void prefault_stack(void);
+static void lock_dock_memory(void);
+static void read_inherited_nice(void);
+static void restore_inherited_nice(const char *);
+static void raise_priority(void);
 static int handle_error_event(Display *, XErrorEvent *);
 static int handle_io_error_event(Display *);
 static void handle_create_event(const XEvent *);
 static void handle_button_press_event(const XEvent *);
-static void handle_expose_event(Window);
+static void handle_expose_event(const XExposeEvent *);
+static void paint_tile(unsigned);
+static void paint_dirty_tiles(void);
+#ifdef USE_RANDR
+static void handle_screen_change_event(XEvent *);
+#endif
+static void handle_event(XEvent *);
 static void parse_opts(int, char *[]);
 static void daemonize(void);
 static void setup_display(void);
+static void update_root_events(void);
 static void create_dock_window(void);
+static Pixmap acquire_pixmap(uint64_t, int *);
+static void release_pixmap(Pixmap);
+static void compose_background(void);
+static void compose_launcher(unsigned);
+#ifdef USE_SVG
+static int reload_image(image_t *, const char *);
+static void refresh_launchers(const image_t *);
+static void refresh_tiles(void);
+#endif
+static int find_task(Window);
+static int check_skip_taskbar(Window);
+static void compose_task(unsigned);
+static void create_task(unsigned);
+static void destroy_task(struct task *);
+static void shift_tiles(int);
+static void update_tasks(const Window *, unsigned long);
+static void activate_task(unsigned);
 static void create_launchers(void);
+static void create_control_socket(void);
+static void create_pressure_trigger(void);
+static void create_power_monitor(void);
+static void create_idle_monitor(void);
+static void remove_control_socket(void);
+static double read_pressure(const char *);
+static int check_system_busy(void);
+static void start_dockapp(unsigned);
+static void start_pending_dockapps(void);
 static void start_dockapps(void);
 static void terminate_dockapps(void);
+static void run_event_loop(void);
 
 // clang-format off
 static const char USAGE[] =
@@ -120,40 +592,191 @@ static const char USAGE[] =
     "Options:\n"
     "  -a            Show on all virtual desktops\n"
     "  -A            Show on top of all windows\n"
+    "  -W            Bypass the window manager for the dock and dockapps\n"
     "  -x POSITION   X coordinate (default: 0)\n"
     "  -y POSITION   Y coordinate (default: 0)\n"
+    "  -o OUTPUT     Place relative to XRandR output (name or 'primary')\n"
+    "  -g GRAVITY    Corner to place relative to (nw, ne, sw, se, default: nw)\n"
     "  -s SIZE       Tile size in pixels (default: 64)\n"
     "  -b IMAGE      Tile background image (default: tile-default.png)\n"
     "  -H            Use horizontal layout\n"
     "  -D DECOR      Window decorations hints (default: 0x00)\n"
     "  -f FUNCS      Window functions hints (default: 0x00)\n"
+    "  -S PATH       Listen for commands on a UNIX datagram socket\n"
+    "  -j JOBS       Max dockapps starting at the same time (default: 0, unlimited)\n"
+    "  -l LOAD       Delay starting dockapps while load average exceeds LOAD\n"
+    "  -L PERCENT    Delay starting dockapps while CPU pressure exceeds PERCENT\n"
+    "  -B            Switch to power saving profile when on battery\n"
+    "  -I            Freeze dockapps while the screen is blanked\n"
+    "  -F            Freeze dockapps while a fullscreen window covers the dock\n"
+    "  -O            Overlay tiles with render and event statistics\n"
+    "  -M            Lock the dock's memory after startup\n"
+    "  -N NICE       Run the dock at the given nice level (e.g. -5)\n"
     "  -d            Daemonize after swallowing all dockapps\n"
+    "  -E            With -d, daemonize as soon as the dock is mapped\n"
     "  -r NAME       Resource name for dockapp in the next tile\n"
     "  -i ICON       Icon path for launcher in the next tile\n"
     "  -c COMMAND    Command to execute in the next tile\n"
-    "  -t TYPE       Add tile (dockapp or launcher)\n"
+    "  -p PRIORITY   Start priority for dockapp in the next tile (default: 0)\n"
+    "  -t TYPE       Add tile (dockapp, launcher or tasks)\n"
     "  -v            Show debug messages\n"
     "  -h            Display this help message\n";
 // clang-format on
 
+static void (*const TIMER_CALLBACKS[TIMER_COUNT])(void) = {
+    [TIMER_PLACEHOLDER] = handle_placeholder_timer,
+    [TIMER_BADGE] = handle_badge_timer,
+    [TIMER_STARTUP] = start_pending_dockapps,
+    [TIMER_PRESSURE] = handle_pressure_relief_timer,
+    [TIMER_DPMS] = handle_dpms_timer,
+    [TIMER_LAUNCH] = handle_launch_timer,
+    [TIMER_SWALLOW] = handle_swallow_timer,
+    [TIMER_HUD] = handle_hud_timer,
+};
+
+static void (*const WATCH_HANDLERS[WATCH_COUNT])(int) = {
+    [WATCH_DISPLAY] = NULL,
+    [WATCH_CONTROL] = handle_control_socket,
+    [WATCH_PRESSURE] = handle_memory_pressure,
+    [WATCH_POWER] = handle_power_event,
+#ifdef USE_SVG
+    [WATCH_SVG] = handle_svg_done,
+#endif
+    [WATCH_CHILD] = handle_child_pipe,
+};
+
+static char *const ATOM_NAMES[ATOM_COUNT] = {
+    [ATOM_MOTIF_WM_HINTS] = "_MOTIF_WM_HINTS",
+    [ATOM_NET_ACTIVE_WINDOW] = "_NET_ACTIVE_WINDOW",
+    [ATOM_NET_CLIENT_LIST] = "_NET_CLIENT_LIST",
+    [ATOM_NET_CLIENT_LIST_STACKING] = "_NET_CLIENT_LIST_STACKING",
+    [ATOM_NET_SUPPORTING_WM_CHECK] = "_NET_SUPPORTING_WM_CHECK",
+    [ATOM_NET_WM_DESKTOP] = "_NET_WM_DESKTOP",
+    [ATOM_NET_WM_ICON] = "_NET_WM_ICON",
+    [ATOM_NET_WM_PID] = "_NET_WM_PID",
+    [ATOM_NET_WM_STATE] = "_NET_WM_STATE",
+    [ATOM_NET_WM_STATE_ABOVE] = "_NET_WM_STATE_ABOVE",
+    [ATOM_NET_WM_STATE_FULLSCREEN] = "_NET_WM_STATE_FULLSCREEN",
+    [ATOM_NET_WM_STATE_SKIP_TASKBAR] = "_NET_WM_STATE_SKIP_TASKBAR",
+};
+
+static const struct platform PLATFORM_X11 = {
+    .bypass_window_manager = bypass_window_manager,
+    .check_window_manager = check_window_manager,
+    .get_icon_window = get_icon_window,
+    .get_time_us = read_monotonic_us,
+    .get_window_size = get_window_size,
+    .map_window = map_window,
+    .reparent_window = reparent_window,
+    .select_root_events = select_root_events,
+    .set_border_width = set_border_width,
+    .signal_process = signal_process,
+    .spawn_process = spawn_process,
+    .unmap_window = unmap_window,
+    .wait_child = wait_child,
+};
+
+static const struct profile PROFILES[] = {
+    [PROFILE_AC] = {
+        .name = "AC",
+        .animations = 1,
+        .badge_interval_ms = 100,
+        .freeze_hidden = 0,
+        .sample_interval_ms = 500,
+        .timer_slack_ns = 0,
+    },
+    [PROFILE_BATTERY] = {
+        .name = "battery",
+        .animations = 0,
+        .badge_interval_ms = 1000,
+        .freeze_hidden = 1,
+        .sample_interval_ms = 2000,
+        .timer_slack_ns = 50000000,
+    },
+};
+
 static struct app app = {
     .above_all = 0,
+    .active_window = None,
     .all_desktops = 0,
+    .atoms = { None },
+    .badge_painted_at = 0,
     .bg_image = NULL,
+    .bg_path = DEFAULT_BG_PATH,
+    .bg_pixels = NULL,
+    .bg_pixmap = None,
+    .child_count = 0,
+    .child_exited = 0,
+    .child_pipe = { -1, -1 },
+    .client_count = 0,
+    .client_list = NULL,
+    .control_path = NULL,
     .daemon_mode = 0,
+    .damage_event_base = -1,
     .display = NULL,
+    .dock_hidden = 0,
+    .dock_pos = { 0, 0 },
     .dock_window = None,
+    .dpms_capable = 0,
+    .dpms_check_ms = DPMS_CHECK_MAX_MS,
+    .early_daemon = 0,
+    .freeze_reasons = 0,
+    .fullscreen_yield = 0,
+    .gc = NULL,
+    .glyphs = { None, 0, 0, 0, 0 },
+    .gravity = 0,
     .horizontal = 0,
+    .hud = 0,
+    .hud_gc = NULL,
+    .hud_refreshed_at = 0,
+    .idle_freeze = 0,
+    .image_cache_size = 0,
+    .inherited_nice = 0,
     .initial_x = 0,
     .initial_y = 0,
+    .last_launch_at = 0,
+    .lock_memory = 0,
+    .max_cpu_pressure = 0,
+    .max_jobs = 0,
+    .max_load = 0,
     .mwm_decor = 0,
     .mwm_funcs = 0,
+    .nice_level = 0,
+    .output_name = NULL,
+    .override_redirect = 0,
+    .parent_pid = 0,
+    .pixmaps = NULL,
+    .placeholder_frame = 0,
+    .platform = &PLATFORM_X11,
+    .power_profiles = 0,
+    .profile = &PROFILES[PROFILE_AC],
+    .randr_event_base = -1,
     .root_window = None,
+    .saver_event_base = -1,
     .screen = 0,
+    .started_at = 0,
+#ifdef USE_SVG
+    .svg_failed = NULL,
+    .svg_jobs = NULL,
+    .svg_pipe = { -1, -1 },
+#endif
+    .tasks = NULL,
+    .task_count = 0,
+    .task_tile = -1,
     .tiles = NULL,
     .tile_count = 0,
     .tile_size = 64,
+    .timers = { 0 },
+    .timer_slack_warned = 0,
     .verbose = 0,
+    .watches = {
+        [WATCH_DISPLAY] = { .fd = -1, .events = POLLIN },
+        [WATCH_CONTROL] = { .fd = -1, .events = POLLIN },
+        [WATCH_PRESSURE] = { .fd = -1, .events = POLLPRI },
+        [WATCH_POWER] = { .fd = -1, .events = POLLIN },
+        [WATCH_SVG] = { .fd = -1, .events = POLLIN },
+        [WATCH_CHILD] = { .fd = -1, .events = POLLIN },
+    },
 };
 
 static void
@@ -215,20 +838,126 @@ exit_usage(int status)
     exit(status);
 }
 
+static long long
+read_monotonic_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static long long
+get_time_ms(void)
+{
+    return app.platform->get_time_us() / 1000;
+}
+
+static long long
+get_time_us(void)
+{
+    return app.platform->get_time_us();
+}
+
+static uint64_t
+hash_bytes(uint64_t hash, const void *data, size_t len)
+{
+    const unsigned char *bytes = data;
+
+    // FNV-1a, chained by passing the previous hash
+    for (size_t i = 0; i < len; i++) {
+        hash = (hash ^ bytes[i]) * FNV_PRIME;
+    }
+
+    return hash;
+}
+
+static uint64_t
+hash_file(const char *path)
+{
+    unsigned char buf[4096];
+    uint64_t hash = FNV_OFFSET;
+    FILE *f = fopen(path, "rb");
+    size_t len;
+
+    if (f == NULL) {
+        return hash_bytes(hash, path, strlen(path));
+    }
+
+    while ((len = fread(buf, 1, sizeof(buf), f)) > 0) {
+        hash = hash_bytes(hash, buf, len);
+    }
+
+    fclose(f);
+
+    return hash;
+}
+
+static void
+set_timer(unsigned id, long long delay_ms)
+{
+    app.timers[id] = get_time_ms() + delay_ms;
+}
+
+static void
+cancel_timer(unsigned id)
+{
+    app.timers[id] = 0;
+}
+
 static int
-check_window_manager(void)
+check_timer_paused(unsigned id)
 {
-    Atom net_supporting_wm_check = XInternAtom(app.display, "_NET_SUPPORTING_WM_CHECK", False);
-    Atom actual_type;
-    int actual_format;
-    unsigned long nitems, bytes_after;
-    unsigned char *data = NULL;
+    // While the dock can't be seen, only the DPMS check, swallowing and
+    // the end of memory pressure keep running
+    return (app.freeze_reasons & (FREEZE_IDLE | FREEZE_DPMS | FREEZE_FULLSCREEN))
+        && id != TIMER_DPMS && id != TIMER_SWALLOW && id != TIMER_PRESSURE;
+}
+
+static int
+get_poll_timeout(void)
+{
+    long long now = get_time_ms();
+    long long timeout = -1;
+
+    for (unsigned i = 0; i < TIMER_COUNT; i++) {
+        if (app.timers[i] == 0 || check_timer_paused(i)) {
+            continue;
+        }
+
+        long long remaining = app.timers[i] > now ? app.timers[i] - now : 0;
+
+        if (timeout < 0 || remaining < timeout) {
+            timeout = remaining;
+        }
+    }
+
+    return (int)timeout;
+}
+
+static void
+run_timers(void)
+{
+    long long now = get_time_ms();
+
+    for (unsigned i = 0; i < TIMER_COUNT; i++) {
+        if (app.timers[i] != 0 && app.timers[i] <= now && !check_timer_paused(i)) {
+            // Callbacks re-arm the timer themselves if needed
+            app.timers[i] = 0;
+            TIMER_CALLBACKS[i]();
+        }
+    }
+}
 
-    int status = XGetWindowProperty(app.display, app.root_window, net_supporting_wm_check,
-        0, 1, False, XA_WINDOW, &actual_type,
-        &actual_format, &nitems, &bytes_after, &data);
+static int
+check_window_manager(void)
+{
+    unsigned long nitems;
+    unsigned char *data = get_window_property(app.root_window, app.atoms[ATOM_NET_SUPPORTING_WM_CHECK],
+        XA_WINDOW, 1, &nitems);
 
-    if (status == Success && data) {
+    if (data) {
         XFree(data);
         return 1;
     }
@@ -236,6 +965,18 @@ check_window_manager(void)
     return 0;
 }
 
+static int
+bypass_window_manager(Window window)
+{
+    XSetWindowAttributes attrs = { .override_redirect = True };
+    XWindowAttributes current;
+
+    // Windows which haven't been mapped yet will never be seen by the WM
+    XChangeWindowAttributes(app.display, window, CWOverrideRedirect, &attrs);
+
+    return XGetWindowAttributes(app.display, window, &current) && current.map_state == IsUnmapped;
+}
+
 static Window
 get_icon_window(Window window)
 {
@@ -255,25 +996,6 @@ get_icon_window(Window window)
     return ret;
 }
 
-static Window
-get_icon_window_waiting(Window window)
-{
-    Window ret = None;
-
-    for (int i = 0; i < 2; ++i) {
-        ret = get_icon_window(window);
-
-        if (ret != None) {
-            break;
-        }
-
-        pm_debug("Waiting for icon window of 0x%lx", window);
-        usleep(100000);
-    }
-
-    return ret;
-}
-
 static struct size
 get_window_size(Window window)
 {
@@ -293,511 +1015,4013 @@ get_window_size(Window window)
 }
 
 static void
-set_wm_class_hint(Window window, const char *res_name, const char *res_class)
+map_window(Window window)
 {
-    XClassHint *class_hint = XAllocClassHint();
-    pm_assert(class_hint != NULL, "Failed to allocate class hint");
+    XMapRaised(app.display, window);
+}
 
-    class_hint->res_name = (char *)res_name;
-    class_hint->res_class = (char *)res_class;
+static void
+reparent_window(Window window, struct position pos)
+{
+    XReparentWindow(app.display, window, app.dock_window, pos.x, pos.y);
+}
 
-    XSetClassHint(app.display, window, class_hint);
-    XFree(class_hint);
+static void
+select_root_events(long mask)
+{
+    XSelectInput(app.display, app.root_window, mask);
 }
 
 static void
-set_mwm_hints(Window window, unsigned long flags, unsigned long funcs, unsigned long decor)
+set_border_width(Window window, unsigned width)
 {
-    Atom motif_hints_atom = XInternAtom(app.display, "_MOTIF_WM_HINTS", False);
-    unsigned long hints[5] = { flags, funcs, decor, 0, 0 };
+    XSetWindowBorderWidth(app.display, window, width);
+}
 
-    XChangeProperty(app.display, window, motif_hints_atom, motif_hints_atom, 32,
-        PropModeReplace, (unsigned char *)&hints, 5);
+static void
+unmap_window(Window window)
+{
+    XUnmapWindow(app.display, window);
 }
 
+#ifdef USE_NATIVE_IMAGES
+
 static void
-set_wm_desktop_hint(Window window, int32_t value)
+setup_images(void)
 {
-    Atom net_wm_desktop = XInternAtom(app.display, "_NET_WM_DESKTOP", False);
-    XChangeProperty(app.display, window, net_wm_desktop, XA_CARDINAL, 32,
-        PropModeReplace, (unsigned char *)&value, 1);
+    // Pixels are encoded directly from the visual's color masks
+    pm_assert(DefaultVisual(app.display, app.screen)->class == TrueColor,
+        "Built-in image renderer requires a TrueColor visual, build with Imlib2 instead");
+}
 
-    pm_debug("Set _NET_WM_DESKTOP hint for window 0x%lx to %d", window, value);
+static unsigned char *
+read_file(const char *path, size_t *len)
+{
+    FILE *f = fopen(path, "rb");
+    unsigned char *data = NULL;
+    long size;
+
+    if (f == NULL) {
+        return NULL;
+    }
+
+    if (fseek(f, 0, SEEK_END) == 0 && (size = ftell(f)) > 0 && fseek(f, 0, SEEK_SET) == 0) {
+        data = malloc(size + 1);
+
+        if (data && fread(data, 1, size, f) == (size_t)size) {
+            data[size] = '\0';
+            *len = size;
+        } else {
+            free(data);
+            data = NULL;
+        }
+    }
+
+    fclose(f);
+
+    return data;
 }
 
-static void
-set_wm_above_hint(Window window)
+static image_t
+image_create(unsigned width, unsigned height)
 {
-    Atom net_wm_state = XInternAtom(app.display, "_NET_WM_STATE", False);
-    Atom net_wm_state_above = XInternAtom(app.display, "_NET_WM_STATE_ABOVE", False);
+    if (width == 0 || height == 0 || width > IMAGE_MAX_SIZE || height > IMAGE_MAX_SIZE) {
+        return NULL;
+    }
 
-    XChangeProperty(app.display, window, net_wm_state, XA_ATOM, 32,
-        PropModeReplace, (unsigned char *)&net_wm_state_above, 1);
+    image_t image = malloc(sizeof(struct image));
+    pm_assert(image != NULL, "Failed to allocate memory");
 
-    pm_debug("Set _NET_WM_STATE_ABOVE hint for window 0x%lx", window);
+    image->width = width;
+    image->height = height;
+    image->pixels = calloc((size_t)width * height, sizeof(uint32_t));
+    pm_assert(image->pixels != NULL, "Failed to allocate memory");
+
+    return image;
 }
 
-static struct position
-get_tile_position(unsigned index)
+static uint32_t
+read_be32(const unsigned char *p)
 {
-    return (struct position) {
-        .x = app.horizontal ? index * app.tile_size : 0,
-        .y = app.horizontal ? 0 : index * app.tile_size
-    };
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+static unsigned
+png_paeth(int a, int b, int c)
+{
+    int p = a + b - c;
+    int pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+
+    return pa <= pb && pa <= pc ? a : pb <= pc ? b : c;
 }
 
 static int
-check_all_dockapps_swallowed(void)
+check_png_depth(unsigned color, unsigned depth)
 {
-    for (unsigned i = 0; i < app.tile_count; i++) {
-        if (app.tiles[i].type == TILE_TYPE_APP && app.tiles[i].window == 0) {
-            return 0;
-        }
+    // Bit depths allowed by the PNG specification for each color type
+    switch (color) {
+    case 0:
+        return depth == 1 || depth == 2 || depth == 4 || depth == 8 || depth == 16;
+    case 3:
+        return depth == 1 || depth == 2 || depth == 4 || depth == 8;
+    default:
+        return depth == 8 || depth == 16;
     }
-
-    return 1;
 }
 
-void
-swallow_dockapp(Window main_window, int index)
+static image_t
+decode_png(const unsigned char *data, size_t len)
 {
-    pm_debug("Swallowing dockapp with main window 0x%lx at index %d", main_window, index);
+    unsigned width = 0, height = 0, depth = 0, color = 0, channels = 0;
+    unsigned char palette[256][4];
+    unsigned key[3] = { 0, 0, 0 };
+    int has_key = 0;
+    unsigned char *raw = NULL;
+    size_t stride = 0, raw_len = 0;
+    z_stream zs = { 0 };
+    image_t image = NULL;
+
+    memset(palette, 0xff, sizeof(palette));
+
+    if (inflateInit(&zs) != Z_OK) {
+        return NULL;
+    }
 
-    int wm_running = check_window_manager();
+    for (size_t pos = 8; pos + 12 <= len;) {
+        uint32_t chunk_len = read_be32(data + pos);
+        const unsigned char *type = data + pos + 4;
+        const unsigned char *body = data + pos + 8;
 
-    if (wm_running) {
-        pm_warn("Window manager detected, swallowing dockapp with workaround");
+        if (chunk_len > len - pos - 12) {
+            goto out;
+        }
 
-        // Give the WM time to handle the new window
-        usleep(100000);
-    }
+        if (memcmp(type, "IHDR", 4) == 0 && chunk_len >= 13) {
+            static const unsigned CHANNELS[] = { 1, 0, 3, 1, 2, 0, 4 };
 
-    Window icon_window = get_icon_window_waiting(main_window);
+            width = read_be32(body);
+            height = read_be32(body + 4);
+            depth = body[8];
+            color = body[9];
 
-    if (icon_window == None) {
-        pm_warn("Window 0x%lx has no icon window, skipping", main_window);
-        return;
-    }
+            // Interlaced images are not supported
+            if (color > 6 || CHANNELS[color] == 0 || body[12] != 0 || raw != NULL) {
+                goto out;
+            }
 
-    app.tiles[index].window = icon_window;
+            if (!check_png_depth(color, depth)) {
+                pm_warn("Invalid PNG bit depth %u for color type %u", depth, color);
+                goto out;
+            }
 
-    XSetWindowBorderWidth(app.display, icon_window, 0);
+            if ((image = image_create(width, height)) == NULL) {
+                goto out;
+            }
 
-    struct size size = get_window_size(icon_window);
-    struct position tile_pos = get_tile_position(index);
-    int icon_x = tile_pos.x + (app.tile_size - size.width) / 2;
-    int icon_y = tile_pos.y + (app.tile_size - size.height) / 2;
-    int main_x = app.horizontal ? icon_x : (int)app.tile_size * 2;
-    int main_y = app.horizontal ? (int)app.tile_size * 2 : icon_y;
+            channels = CHANNELS[color];
+            stride = ((size_t)width * channels * depth + 7) / 8;
+            raw_len = (stride + 1) * height;
+            raw = malloc(raw_len);
+            pm_assert(raw != NULL, "Failed to allocate memory");
+
+            zs.next_out = raw;
+            zs.avail_out = raw_len;
+        } else if (memcmp(type, "PLTE", 4) == 0) {
+            for (unsigned i = 0; i < chunk_len / 3 && i < 256; i++) {
+                memcpy(palette[i], body + i * 3, 3);
+            }
+        } else if (memcmp(type, "tRNS", 4) == 0) {
+            if (color == 3) {
+                for (unsigned i = 0; i < chunk_len && i < 256; i++) {
+                    palette[i][3] = body[i];
+                }
+            } else if (color == 0 && chunk_len >= 2) {
+                key[0] = body[0] << 8 | body[1];
+                has_key = 1;
+            } else if (color == 2 && chunk_len >= 6) {
+                for (unsigned i = 0; i < 3; i++) {
+                    key[i] = body[i * 2] << 8 | body[i * 2 + 1];
+                }
+                has_key = 1;
+            }
+        } else if (memcmp(type, "IDAT", 4) == 0) {
+            if (raw == NULL) {
+                goto out;
+            }
 
-    if (wm_running) {
-        // Unmap/reparent windows and give the WM time to process it.
-        XUnmapWindow(app.display, main_window);
-        XUnmapWindow(app.display, icon_window);
-        XFlush(app.display);
-        usleep(50000);
-        XReparentWindow(app.display, main_window, app.dock_window, main_x, main_y);
-        XReparentWindow(app.display, icon_window, app.dock_window, icon_x, icon_y);
-        XFlush(app.display);
-        usleep(50000);
+            zs.next_in = (unsigned char *)body;
+            zs.avail_in = chunk_len;
+
+            int ret = inflate(&zs, Z_NO_FLUSH);
+
+            if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR) {
+                goto out;
+            }
+        } else if (memcmp(type, "IEND", 4) == 0) {
+            break;
+        }
+
+        pos += chunk_len + 12;
     }
 
-    XReparentWindow(app.display, main_window, app.dock_window, main_x, main_y);
-    XReparentWindow(app.display, icon_window, app.dock_window, icon_x, icon_y);
-    XMapRaised(app.display, main_window);
-    XMapRaised(app.display, icon_window);
-    XFlush(app.display);
+    if (raw == NULL || zs.total_out != raw_len) {
+        goto out;
+    }
 
-    pm_debug("Swallowed window 0x%lx at %ux%u", icon_window, icon_x, icon_y);
+    size_t bpp = channels * depth / 8 > 0 ? channels * depth / 8 : 1;
+    unsigned max = (1u << depth) - 1;
+
+    for (unsigned y = 0; y < height; y++) {
+        unsigned char *row = raw + y * (stride + 1);
+        unsigned char *cur = row + 1;
+        unsigned char *prev = y > 0 ? cur - (stride + 1) : NULL;
+
+        for (size_t i = 0; i < stride; i++) {
+            unsigned a = i >= bpp ? cur[i - bpp] : 0;
+            unsigned b = prev ? prev[i] : 0;
+            unsigned c = prev && i >= bpp ? prev[i - bpp] : 0;
+
+            switch (row[0]) {
+            case 0:
+                break;
+            case 1:
+                cur[i] += a;
+                break;
+            case 2:
+                cur[i] += b;
+                break;
+            case 3:
+                cur[i] += (a + b) / 2;
+                break;
+            case 4:
+                cur[i] += png_paeth(a, b, c);
+                break;
+            default:
+                goto out;
+            }
+        }
 
-    if (check_all_dockapps_swallowed()) {
-        pm_debug("All dockapps swallowed");
+        for (unsigned x = 0; x < width; x++) {
+            unsigned sample[4], value[4];
 
-        XSelectInput(app.display, app.root_window, 0);
+            for (unsigned ch = 0; ch < channels; ch++) {
+                size_t bit = ((size_t)x * channels + ch) * depth;
 
-        if (app.daemon_mode) {
-            kill(getppid(), SIGUSR1);
+                if (depth == 16) {
+                    sample[ch] = cur[bit / 8] << 8 | cur[bit / 8 + 1];
+                    value[ch] = sample[ch] >> 8;
+                } else {
+                    sample[ch] = (cur[bit / 8] >> (8 - depth - bit % 8)) & max;
+                    value[ch] = color == 3 ? sample[ch] : sample[ch] * 255 / max;
+                }
+            }
+
+            uint32_t argb;
+
+            switch (color) {
+            case 0:
+                argb = (has_key && sample[0] == key[0] ? 0 : 0xffu << 24) | value[0] * 0x010101u;
+                break;
+            case 2:
+                argb = (has_key && sample[0] == key[0] && sample[1] == key[1] && sample[2] == key[2] ? 0 : 0xffu << 24)
+                    | value[0] << 16 | value[1] << 8 | value[2];
+                break;
+            case 3:
+                argb = (uint32_t)palette[value[0]][3] << 24 | palette[value[0]][0] << 16
+                    | palette[value[0]][1] << 8 | palette[value[0]][2];
+                break;
+            case 4:
+                argb = (uint32_t)value[1] << 24 | value[0] * 0x010101u;
+                break;
+            default:
+                argb = (uint32_t)value[3] << 24 | value[0] << 16 | value[1] << 8 | value[2];
+                break;
+            }
+
+            image->pixels[(size_t)y * width + x] = argb;
         }
     }
-}
 
-static void
-handle_sigusr1(int signo)
-{
-    (void)signo; // Unused parameter
+    inflateEnd(&zs);
+    free(raw);
 
-    pm_debug("Exiting parent process");
+    return image;
 
-    exit(0);
+out:
+    inflateEnd(&zs);
+    free(raw);
+    image_free(image);
+
+    return NULL;
 }
 
-static void
-handle_sigterm(int signo)
+static image_t
+decode_farbfeld(const unsigned char *data, size_t len)
 {
-    (void)signo; // Unused parameter
+    if (len < 16) {
+        return NULL;
+    }
 
-    terminate_dockapps();
+    unsigned width = read_be32(data + 8);
+    unsigned height = read_be32(data + 12);
+    image_t image = image_create(width, height);
 
-    exit(0);
+    if (image == NULL || len - 16 < (size_t)width * height * 8) {
+        image_free(image);
+        return NULL;
+    }
+
+    // Pixels are 16-bit big-endian RGBA, keep the high bytes
+    for (size_t i = 0; i < (size_t)width * height; i++) {
+        const unsigned char *p = data + 16 + i * 8;
+        image->pixels[i] = (uint32_t)p[6] << 24 | p[0] << 16 | p[2] << 8 | p[4];
+    }
+
+    return image;
 }
 
 static int
-handle_error_event(Display *display, XErrorEvent *error)
+parse_xpm_color(const char *name, uint32_t *argb)
+{
+    XColor color;
+
+    unsigned r, g, b;
+
+    if (strcasecmp(name, "none") == 0) {
+        *argb = 0;
+        return 1;
+    }
+
+    // Most XPM files use #rrggbb, which doesn't need the color database
+    if (strlen(name) == 7 && sscanf(name, "#%2x%2x%2x", &r, &g, &b) == 3) {
+        *argb = 0xffu << 24 | r << 16 | g << 8 | b;
+        return 1;
+    }
+
+    if (!XParseColor(app.display, DefaultColormap(app.display, app.screen), name, &color)) {
+        return 0;
+    }
+
+    *argb = 0xffu << 24 | (color.red >> 8) << 16 | (color.green >> 8) << 8 | color.blue >> 8;
+
+    return 1;
+}
+
+static image_t
+decode_xpm(const char *data, size_t len)
+{
+    const char **strings = NULL;
+    size_t *lengths = NULL;
+    size_t count = 0, capacity = 0;
+    unsigned width, height, ncolors, cpp;
+    uint32_t *colors = NULL;
+    image_t image = NULL;
+
+    // Collect all string literals and their lengths, skipping comments.
+    // An unterminated string ends at the end of the data.
+    for (size_t i = 0; i < len; i++) {
+        if (data[i] == '/' && i + 1 < len && data[i + 1] == '*') {
+            for (i += 2; i + 1 < len && !(data[i] == '*' && data[i + 1] == '/'); i++) { }
+            i++;
+        } else if (data[i] == '"') {
+            if (count == capacity) {
+                capacity = capacity ? capacity * 2 : 64;
+                strings = realloc(strings, capacity * sizeof(char *));
+                lengths = realloc(lengths, capacity * sizeof(size_t));
+                pm_assert(strings != NULL && lengths != NULL, "Failed to allocate memory");
+            }
+
+            size_t start = i + 1;
+
+            while (++i < len && data[i] != '"') { }
+
+            strings[count] = data + start;
+            lengths[count++] = i - start;
+        }
+    }
+
+    if (count == 0 || sscanf(strings[0], "%u %u %u %u", &width, &height, &ncolors, &cpp) != 4
+        || cpp == 0 || cpp > 4 || ncolors == 0 || count < 1 + (size_t)ncolors + height) {
+        goto out;
+    }
+
+    colors = calloc(ncolors, sizeof(uint32_t));
+    pm_assert(colors != NULL, "Failed to allocate memory");
+
+    for (unsigned i = 0; i < ncolors; i++) {
+        const char *line = strings[1 + i];
+        char buf[256], name[128] = "";
+        size_t line_len = lengths[1 + i];
+
+        if (line_len <= cpp || line_len - cpp >= sizeof(buf)) {
+            goto out;
+        }
+
+        memcpy(buf, line + cpp, line_len - cpp);
+        buf[line_len - cpp] = '\0';
+
+        // Find the color visual ("c"), whose value may span several words
+        char *saveptr = NULL;
+        int in_color = 0;
+
+        for (char *token = strtok_r(buf, " \t", &saveptr); token; token = strtok_r(NULL, " \t", &saveptr)) {
+            int is_key = !strcmp(token, "c") || !strcmp(token, "m") || !strcmp(token, "s")
+                || !strcmp(token, "g") || !strcmp(token, "g4");
+
+            if (is_key) {
+                in_color = !strcmp(token, "c");
+            } else if (in_color && strlen(name) + strlen(token) + 2 < sizeof(name)) {
+                if (name[0]) {
+                    strcat(name, " ");
+                }
+                strcat(name, token);
+            }
+        }
+
+        if (!parse_xpm_color(name, &colors[i])) {
+            pm_warn("Unknown XPM color '%s'", name);
+            goto out;
+        }
+    }
+
+    if ((image = image_create(width, height)) == NULL) {
+        goto out;
+    }
+
+    for (unsigned y = 0; y < height; y++) {
+        const char *row = strings[1 + ncolors + y];
+        unsigned last = 0;
+
+        if (lengths[1 + ncolors + y] < (size_t)width * cpp) {
+            goto out;
+        }
+
+        for (unsigned x = 0; x < width; x++) {
+            const char *pixel = row + (size_t)x * cpp;
+
+            // Neighbouring pixels usually share colors, so try the last match first
+            if (memcmp(pixel, strings[1 + last], cpp) != 0) {
+                for (last = 0; last < ncolors && memcmp(pixel, strings[1 + last], cpp) != 0; last++) { }
+
+                if (last == ncolors) {
+                    goto out;
+                }
+            }
+
+            image->pixels[(size_t)y * width + x] = colors[last];
+        }
+    }
+
+    free(colors);
+    free(strings);
+    free(lengths);
+
+    return image;
+
+out:
+    free(colors);
+    free(strings);
+    free(lengths);
+    image_free(image);
+
+    return NULL;
+}
+
+static image_t
+image_load(const char *path)
+{
+    size_t len = 0;
+    unsigned char *data = read_file(path, &len);
+    image_t image = NULL;
+
+    if (data == NULL) {
+        return NULL;
+    }
+
+    if (len > 8 && memcmp(data, "\x89PNG\r\n\x1a\n", 8) == 0) {
+        image = decode_png(data, len);
+    } else if (len > 8 && memcmp(data, "farbfeld", 8) == 0) {
+        image = decode_farbfeld(data, len);
+    } else if (strstr((char *)data, "XPM") != NULL) {
+        image = decode_xpm((char *)data, len);
+    }
+
+    free(data);
+
+    return image;
+}
+
+static void
+image_free(image_t image)
+{
+    if (image != NULL) {
+        free(image->pixels);
+        free(image);
+    }
+}
+
+static struct size
+image_get_size(image_t image)
+{
+    return (struct size) { image->width, image->height };
+}
+
+static uint32_t *
+scale_pixels(image_t image, unsigned width, unsigned height)
+{
+    uint32_t *ret = malloc((size_t)width * height * sizeof(uint32_t));
+    pm_assert(ret != NULL, "Failed to allocate memory");
+
+    // Box filter, each target pixel averages the source pixels it covers
+    for (unsigned y = 0; y < height; y++) {
+        unsigned y0 = (size_t)y * image->height / height;
+        unsigned y1 = (size_t)(y + 1) * image->height / height;
+
+        y1 = y1 > y0 ? y1 : y0 + 1;
+
+        for (unsigned x = 0; x < width; x++) {
+            unsigned x0 = (size_t)x * image->width / width;
+            unsigned x1 = (size_t)(x + 1) * image->width / width;
+            uint64_t sum_a = 0, sum_r = 0, sum_g = 0, sum_b = 0, count = 0;
+
+            x1 = x1 > x0 ? x1 : x0 + 1;
+
+            for (unsigned sy = y0; sy < y1; sy++) {
+                for (unsigned sx = x0; sx < x1; sx++) {
+                    uint32_t p = image->pixels[(size_t)sy * image->width + sx];
+                    unsigned a = p >> 24;
+
+                    // Weight colors by alpha, so transparent pixels don't bleed
+                    sum_a += a;
+                    sum_r += a * (p >> 16 & 0xff);
+                    sum_g += a * (p >> 8 & 0xff);
+                    sum_b += a * (p & 0xff);
+                    count++;
+                }
+            }
+
+            ret[(size_t)y * width + x] = sum_a == 0 ? 0
+                                                    : (uint32_t)(sum_a / count) << 24 | (uint32_t)(sum_r / sum_a) << 16
+                    | (uint32_t)(sum_g / sum_a) << 8 | (uint32_t)(sum_b / sum_a);
+        }
+    }
+
+    return ret;
+}
+
+static void
+image_render(image_t image, Drawable drawable, int x, int y, unsigned width, unsigned height)
+{
+    Visual *visual = DefaultVisual(app.display, app.screen);
+    unsigned long masks[3] = { visual->red_mask, visual->green_mask, visual->blue_mask };
+    unsigned shifts[3], maxes[3];
+    size_t bg_len = (size_t)app.tile_size * app.tile_size;
+
+    // Images are only rendered on the background pixmap, filled black first, and on
+    // tile pixmaps copied from it. Its contents are kept here to blend against, so
+    // nothing has to be read back from the server.
+    if (app.bg_pixels == NULL) {
+        app.bg_pixels = calloc(bg_len, sizeof(uint32_t));
+        pm_assert(app.bg_pixels != NULL, "Failed to allocate memory");
+    } else if (drawable == app.bg_pixmap) {
+        memset(app.bg_pixels, 0, bg_len * sizeof(uint32_t));
+    }
+
+    // Clip to the tile
+    int x0 = x > 0 ? x : 0, y0 = y > 0 ? y : 0;
+    int x1 = x + (int)width < (int)app.tile_size ? x + (int)width : (int)app.tile_size;
+    int y1 = y + (int)height < (int)app.tile_size ? y + (int)height : (int)app.tile_size;
+
+    if (x1 <= x0 || y1 <= y0) {
+        return;
+    }
+
+    uint32_t *pixels = image->pixels;
+
+    if (width != image->width || height != image->height) {
+        pixels = scale_pixels(image, width, height);
+    }
+
+    for (unsigned i = 0; i < 3; i++) {
+        for (shifts[i] = 0; masks[i] && !(masks[i] >> shifts[i] & 1); shifts[i]++) { }
+        maxes[i] = masks[i] >> shifts[i];
+    }
+
+    XImage *ximage = XCreateImage(app.display, visual, DefaultDepth(app.display, app.screen), ZPixmap, 0, NULL,
+        x1 - x0, y1 - y0, 32, 0);
+    pm_assert(ximage != NULL, "Failed to allocate memory");
+
+    ximage->data = malloc((size_t)ximage->bytes_per_line * ximage->height);
+    pm_assert(ximage->data != NULL, "Failed to allocate memory");
+
+    // Blend in client memory, then upload the result at once
+    for (int py = y0; py < y1; py++) {
+        for (int px = x0; px < x1; px++) {
+            uint32_t p = pixels[(size_t)(py - y) * width + (px - x)];
+            uint32_t *dst = &app.bg_pixels[(size_t)py * app.tile_size + px];
+            unsigned a = p >> 24;
+            uint32_t rgb = 0;
+            unsigned long out = 0;
+
+            for (unsigned i = 0; i < 3; i++) {
+                unsigned shift = 16 - i * 8;
+                unsigned value = ((p >> shift & 0xff) * a + (*dst >> shift & 0xff) * (255 - a)) / 255;
+
+                rgb |= (uint32_t)value << shift;
+                out |= ((unsigned long)value * maxes[i] / 255) << shifts[i];
+            }
+
+            if (drawable == app.bg_pixmap) {
+                *dst = rgb;
+            }
+
+            XPutPixel(ximage, px - x0, py - y0, out);
+        }
+    }
+
+    XPutImage(app.display, drawable, app.gc, ximage, 0, 0, x0, y0, x1 - x0, y1 - y0);
+    XDestroyImage(ximage);
+
+    if (pixels != image->pixels) {
+        free(pixels);
+    }
+}
+
+static image_t
+image_from_pixels(unsigned width, unsigned height, const uint32_t *pixels)
+{
+    image_t image = image_create(width, height);
+
+    if (image != NULL) {
+        memcpy(image->pixels, pixels, (size_t)width * height * sizeof(uint32_t));
+    }
+
+    return image;
+}
+
+static void
+image_set_cache(int enabled)
+{
+    // Decoded images are the only copies, there is no cache to shrink
+    (void)enabled;
+}
+
+#else
+
+static void
+setup_images(void)
+{
+    imlib_context_set_display(app.display);
+    imlib_context_set_visual(DefaultVisual(app.display, app.screen));
+    imlib_context_set_colormap(DefaultColormap(app.display, app.screen));
+}
+
+static image_t
+image_load(const char *path)
+{
+    return imlib_load_image(path);
+}
+
+static void
+image_free(image_t image)
+{
+    if (image != NULL) {
+        imlib_context_set_image(image);
+        imlib_free_image_and_decache();
+    }
+}
+
+static struct size
+image_get_size(image_t image)
+{
+    imlib_context_set_image(image);
+
+    return (struct size) { imlib_image_get_width(), imlib_image_get_height() };
+}
+
+static void
+image_render(image_t image, Drawable drawable, int x, int y, unsigned width, unsigned height)
+{
+    imlib_context_set_drawable(drawable);
+    imlib_context_set_image(image);
+    imlib_render_image_on_drawable_at_size(x, y, width, height);
+}
+
+static image_t
+image_from_pixels(unsigned width, unsigned height, const uint32_t *pixels)
+{
+    image_t image = imlib_create_image_using_copied_data(width, height, (DATA32 *)pixels);
+
+    if (image != NULL) {
+        imlib_context_set_image(image);
+        imlib_image_set_has_alpha(1);
+    }
+
+    return image;
+}
+
+static void
+image_set_cache(int enabled)
+{
+    if (!enabled) {
+        app.image_cache_size = imlib_get_cache_size();
+        imlib_set_cache_size(0);
+    } else {
+        imlib_set_cache_size(app.image_cache_size);
+    }
+}
+
+#endif
+
+#ifdef USE_SVG
+
+static int
+check_svg_path(const char *path)
+{
+    size_t len = strlen(path);
+
+    return len > 4 && strcasecmp(path + len - 4, ".svg") == 0;
+}
+
+static void
+get_svg_cache_path(const char *path, unsigned size, char *buf, size_t buf_len)
+{
+    const char *cache_home = getenv("XDG_CACHE_HOME");
+    const char *home = getenv("HOME");
+    char key[PATH_MAX + 64];
+    struct stat st = { 0 };
+    uint64_t hash;
+
+    // Key rasterized images by source file, its mtime and size, and tile size
+    stat(path, &st);
+    snprintf(key, sizeof(key), "%s:%lld:%lld:%u", path, (long long)st.st_mtime, (long long)st.st_size, size);
+    hash = hash_bytes(FNV_OFFSET, key, strlen(key));
+
+    if (cache_home && cache_home[0]) {
+        snprintf(buf, buf_len, "%s/pmdock/%016llx.ff", cache_home, (unsigned long long)hash);
+    } else {
+        snprintf(buf, buf_len, "%s/.cache/pmdock/%016llx.ff", home ? home : "/tmp", (unsigned long long)hash);
+    }
+}
+
+static int
+write_farbfeld(const char *path, const uint32_t *pixels, unsigned width, unsigned height)
+{
+    char tmp_path[PATH_MAX + 16];
+    unsigned char header[16] = "farbfeld";
+    FILE *f;
+
+    // Create missing cache directories, ignoring errors
+    snprintf(tmp_path, sizeof(tmp_path), "%s", path);
+
+    for (char *p = strchr(tmp_path + 1, '/'); p; p = strchr(p + 1, '/')) {
+        *p = '\0';
+        mkdir(tmp_path, 0755);
+        *p = '/';
+    }
+
+    // Write to a temporary file first, so readers never see partial images
+    snprintf(tmp_path, sizeof(tmp_path), "%s.%d", path, getpid());
+
+    if ((f = fopen(tmp_path, "wb")) == NULL) {
+        return 0;
+    }
+
+    for (unsigned i = 0; i < 4; i++) {
+        header[8 + i] = width >> (24 - i * 8);
+        header[12 + i] = height >> (24 - i * 8);
+    }
+
+    fwrite(header, 1, sizeof(header), f);
+
+    for (size_t i = 0; i < (size_t)width * height; i++) {
+        unsigned char rgba[8];
+        unsigned channels[4] = { pixels[i] >> 16 & 0xff, pixels[i] >> 8 & 0xff, pixels[i] & 0xff, pixels[i] >> 24 };
+
+        for (unsigned j = 0; j < 4; j++) {
+            rgba[j * 2] = rgba[j * 2 + 1] = channels[j];
+        }
+
+        fwrite(rgba, 1, sizeof(rgba), f);
+    }
+
+    if (fclose(f) != 0 || rename(tmp_path, path) != 0) {
+        unlink(tmp_path);
+        return 0;
+    }
+
+    return 1;
+}
+
+static void *
+rasterize_svg(void *arg)
+{
+    struct svg_job *job = arg;
+    GError *error = NULL;
+    RsvgHandle *handle = rsvg_handle_new_from_file(job->path, &error);
+
+    // Runs on a worker thread, so it must not touch Xlib or the app state
+    if (handle != NULL) {
+        cairo_surface_t *surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, job->size, job->size);
+        cairo_t *cr = cairo_create(surface);
+        RsvgRectangle viewport = { 0, 0, job->size, job->size };
+
+        if (rsvg_handle_render_document(handle, cr, &viewport, &error)) {
+            unsigned char *data;
+            int stride;
+
+            cairo_surface_flush(surface);
+            data = cairo_image_surface_get_data(surface);
+            stride = cairo_image_surface_get_stride(surface);
+
+            job->pixels = malloc((size_t)job->size * job->size * sizeof(uint32_t));
+
+            if (job->pixels == NULL) {
+                snprintf(job->error, sizeof(job->error), "Failed to allocate memory");
+            }
+
+            // Cairo uses premultiplied alpha
+            for (unsigned y = 0; job->pixels && y < job->size; y++) {
+                for (unsigned x = 0; x < job->size; x++) {
+                    uint32_t p = *(uint32_t *)(data + y * stride + x * 4);
+                    unsigned a = p >> 24;
+
+                    job->pixels[y * job->size + x] = a == 0 ? 0
+                                                            : (uint32_t)a << 24 | ((p >> 16 & 0xff) * 255 / a) << 16
+                            | ((p >> 8 & 0xff) * 255 / a) << 8 | (p & 0xff) * 255 / a;
+                }
+            }
+
+            if (job->pixels && !write_farbfeld(job->cache_path, job->pixels, job->size, job->size)) {
+                job->cache_failed = 1;
+            }
+        }
+
+        cairo_destroy(cr);
+        cairo_surface_destroy(surface);
+        g_object_unref(handle);
+    }
+
+    if (error != NULL) {
+        snprintf(job->error, sizeof(job->error), "%s", error->message);
+        g_error_free(error);
+    }
+
+    // Pointers are written atomically, the pipe can't fill up with the few
+    // jobs in flight. There is no way to report a failure from here.
+    while (write(job->notify_fd, &job, sizeof(job)) < 0 && errno == EINTR) { }
+
+    return NULL;
+}
+
+static void
+start_svg_job(image_t *image, const char *path, const char *cache_path)
+{
+    pthread_t thread;
+
+    // Launchers sharing an icon file wait for the same job
+    for (struct svg_job *job = app.svg_jobs; job; job = job->next) {
+        if (job->image == image || strcmp(job->path, path) == 0) {
+            return;
+        }
+    }
+
+    // Files that failed once would fail again, and recomposing the tile
+    // after each attempt would retry them forever
+    for (struct svg_job *job = app.svg_failed; job; job = job->next) {
+        if (strcmp(job->path, path) == 0) {
+            return;
+        }
+    }
+
+    if (app.svg_pipe[0] < 0) {
+        pm_assert(pipe(app.svg_pipe) == 0, "Failed to create pipe");
+        fcntl(app.svg_pipe[0], F_SETFD, FD_CLOEXEC);
+        fcntl(app.svg_pipe[1], F_SETFD, FD_CLOEXEC);
+        app.watches[WATCH_SVG].fd = app.svg_pipe[0];
+    }
+
+    struct svg_job *job = calloc(1, sizeof(struct svg_job));
+    pm_assert(job != NULL, "Failed to allocate memory");
+
+    snprintf(job->cache_path, sizeof(job->cache_path), "%s", cache_path);
+    job->image = image;
+    job->path = path;
+    job->size = app.tile_size;
+    job->notify_fd = app.svg_pipe[1];
+    job->next = app.svg_jobs;
+    app.svg_jobs = job;
+
+    pm_debug("Rasterizing %s at %upx", path, job->size);
+
+    pm_assert(pthread_create(&thread, NULL, rasterize_svg, job) == 0, "Failed to start thread");
+    pthread_detach(thread);
+}
+
+static void
+handle_svg_done(int fd)
+{
+    struct svg_job *job;
+
+    if (read(fd, &job, sizeof(job)) != sizeof(job)) {
+        return;
+    }
+
+    for (struct svg_job **p = &app.svg_jobs; *p; p = &(*p)->next) {
+        if (*p == job) {
+            *p = job->next;
+            break;
+        }
+    }
+
+    if (job->error[0]) {
+        pm_warn("Failed to rasterize %s: %s", job->path, job->error);
+    }
+
+    if (job->cache_failed) {
+        pm_warn("Failed to write cache file %s", job->cache_path);
+    }
+
+    // Failed jobs are kept as a record, so the file isn't tried again
+    if (job->pixels == NULL) {
+        job->next = app.svg_failed;
+        app.svg_failed = job;
+    } else {
+        *job->image = image_from_pixels(job->size, job->size, job->pixels);
+        pm_debug("Rasterized %s", job->path);
+    }
+
+    // Everything is composed over the background, and tasks wait for it even
+    // if it failed. An icon only affects its launchers.
+    if (job->image == &app.bg_image) {
+        refresh_tiles();
+    } else if (job->pixels != NULL) {
+        refresh_launchers(job->image);
+    }
+
+    if (job->pixels != NULL) {
+        free(job->pixels);
+        free(job);
+    }
+}
+
+static int
+check_svg_pending(const image_t *image)
+{
+    for (struct svg_job *job = app.svg_jobs; job; job = job->next) {
+        if (job->image == image) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+#endif
+
+static image_t
+load_image(image_t *image, const char *path)
+{
+    if (*image != NULL) {
+        return *image;
+    }
+
+#ifdef USE_SVG
+    // Vector images are rasterized at the tile size in the background,
+    // the tile is recomposed once the image is ready
+    if (check_svg_path(path)) {
+        char cache_path[PATH_MAX];
+
+        get_svg_cache_path(path, app.tile_size, cache_path, sizeof(cache_path));
+
+        if ((*image = image_load(cache_path)) == NULL) {
+            pm_assert(access(path, R_OK) == 0, "Failed to load image %s", path);
+            start_svg_job(image, path, cache_path);
+            return NULL;
+        }
+
+        pm_debug("Loaded %s from cache %s", path, cache_path);
+        return *image;
+    }
+#endif
+
+    *image = image_load(path);
+    pm_assert(*image != NULL, "Failed to load image %s", path);
+    pm_debug("Loaded image %s", path);
+
+    return *image;
+}
+
+static void
+free_image(image_t *image)
+{
+    image_free(*image);
+    *image = NULL;
+}
+
+static void
+render_image_centered(image_t image, Drawable drawable)
+{
+    struct size size = image_get_size(image);
+
+    // Scale down images which don't fit the tile, keeping the aspect ratio
+    if (size.width > app.tile_size || size.height > app.tile_size) {
+        unsigned larger = size.width > size.height ? size.width : size.height;
+
+        size.width = size.width * app.tile_size / larger;
+        size.height = size.height * app.tile_size / larger;
+    }
+
+    image_render(image, drawable, (app.tile_size - size.width) / 2, (app.tile_size - size.height) / 2,
+        size.width, size.height);
+}
+
+static unsigned char *
+get_window_property(Window window, Atom property, Atom type, unsigned long max_items, unsigned long *nitems)
+{
+    Atom actual_type;
+    int actual_format;
+    unsigned long bytes_after;
+    unsigned char *data = NULL;
+
+    int status = XGetWindowProperty(app.display, window, property, 0, max_items, False, type,
+        &actual_type, &actual_format, nitems, &bytes_after, &data);
+
+    if (status != Success || data == NULL || actual_type != type || *nitems == 0) {
+        if (data) {
+            XFree(data);
+        }
+
+        *nitems = 0;
+        return NULL;
+    }
+
+    return data;
+}
+
+static void
+set_wm_class_hint(Window window, const char *res_name, const char *res_class)
+{
+    XClassHint *class_hint = XAllocClassHint();
+    pm_assert(class_hint != NULL, "Failed to allocate class hint");
+
+    class_hint->res_name = (char *)res_name;
+    class_hint->res_class = (char *)res_class;
+
+    XSetClassHint(app.display, window, class_hint);
+    XFree(class_hint);
+}
+
+static void
+set_mwm_hints(Window window, unsigned long flags, unsigned long funcs, unsigned long decor)
+{
+    Atom motif_hints_atom = app.atoms[ATOM_MOTIF_WM_HINTS];
+    unsigned long hints[5] = { flags, funcs, decor, 0, 0 };
+
+    XChangeProperty(app.display, window, motif_hints_atom, motif_hints_atom, 32,
+        PropModeReplace, (unsigned char *)&hints, 5);
+}
+
+static void
+set_wm_desktop_hint(Window window, int32_t value)
+{
+    XChangeProperty(app.display, window, app.atoms[ATOM_NET_WM_DESKTOP], XA_CARDINAL, 32,
+        PropModeReplace, (unsigned char *)&value, 1);
+
+    pm_debug("Set _NET_WM_DESKTOP hint for window 0x%lx to %d", window, value);
+}
+
+static void
+set_wm_above_hint(Window window)
+{
+    XChangeProperty(app.display, window, app.atoms[ATOM_NET_WM_STATE], XA_ATOM, 32,
+        PropModeReplace, (unsigned char *)&app.atoms[ATOM_NET_WM_STATE_ABOVE], 1);
+
+    pm_debug("Set _NET_WM_STATE_ABOVE hint for window 0x%lx", window);
+}
+
+static struct position
+get_slot_position(unsigned slot)
+{
+    return (struct position) {
+        .x = app.horizontal ? slot * app.tile_size : 0,
+        .y = app.horizontal ? 0 : slot * app.tile_size
+    };
+}
+
+static unsigned
+get_tile_slot(unsigned index)
+{
+    // The tasks group takes one slot per task, possibly none
+    if (app.task_tile >= 0 && index > (unsigned)app.task_tile) {
+        return index + app.task_count - 1;
+    }
+
+    return index;
+}
+
+static struct position
+get_tile_position(unsigned index)
+{
+    return get_slot_position(get_tile_slot(index));
+}
+
+static struct size
+get_dock_size(void)
+{
+    unsigned slots = app.tile_count > 0 ? get_tile_slot(app.tile_count - 1) + 1 : 0;
+
+    if (app.task_tile == (int)app.tile_count - 1) {
+        slots = app.task_tile + app.task_count;
+    }
+
+    // X windows can't be empty
+    if (slots == 0) {
+        slots = 1;
+    }
+
+    return (struct size) {
+        .width = app.horizontal ? slots * app.tile_size : app.tile_size,
+        .height = app.horizontal ? app.tile_size : slots * app.tile_size
+    };
+}
+
+static struct rect
+get_output_rect(void)
+{
+    struct rect ret = {
+        .x = 0,
+        .y = 0,
+        .width = DisplayWidth(app.display, app.screen),
+        .height = DisplayHeight(app.display, app.screen)
+    };
+
+#ifdef USE_RANDR
+    if (app.randr_event_base < 0 || app.output_name == NULL) {
+        return ret;
+    }
+
+    XRRScreenResources *res = XRRGetScreenResourcesCurrent(app.display, app.root_window);
+
+    if (res == NULL) {
+        return ret;
+    }
+
+    RROutput primary = XRRGetOutputPrimary(app.display, app.root_window);
+    int found = 0;
+
+    for (int i = 0; i < res->noutput && !found; i++) {
+        XRROutputInfo *output = XRRGetOutputInfo(app.display, res, res->outputs[i]);
+
+        if (output == NULL) {
+            continue;
+        }
+
+        int match = strcmp(app.output_name, "primary") == 0
+            ? res->outputs[i] == primary
+            : strcmp(app.output_name, output->name) == 0;
+
+        if (match && output->crtc != None) {
+            XRRCrtcInfo *crtc = XRRGetCrtcInfo(app.display, res, output->crtc);
+
+            if (crtc != NULL) {
+                ret = (struct rect) { crtc->x, crtc->y, crtc->width, crtc->height };
+                found = 1;
+                XRRFreeCrtcInfo(crtc);
+            }
+        }
+
+        XRRFreeOutputInfo(output);
+    }
+
+    XRRFreeScreenResources(res);
+
+    if (!found) {
+        pm_warn("Output %s is not active, placing relative to the screen", app.output_name);
+    }
+#endif
+
+    return ret;
+}
+
+static struct position
+get_dock_position(void)
+{
+    struct rect output = get_output_rect();
+    struct size size = get_dock_size();
+    struct position ret = {
+        .x = output.x + app.initial_x,
+        .y = output.y + app.initial_y
+    };
+
+    if (app.gravity & GRAVITY_EAST) {
+        ret.x = output.x + (int)output.width - (int)size.width - app.initial_x;
+    }
+
+    if (app.gravity & GRAVITY_SOUTH) {
+        ret.y = output.y + (int)output.height - (int)size.height - app.initial_y;
+    }
+
+    return ret;
+}
+
+static void
+move_dock_window(void)
+{
+    struct position pos = get_dock_position();
+    struct size size = get_dock_size();
+
+    XMoveResizeWindow(app.display, app.dock_window, pos.x, pos.y, size.width, size.height);
+    app.dock_pos = pos;
+
+    pm_debug("Moved dock window to +%d+%d", pos.x, pos.y);
+}
+
+static int
+check_all_dockapps_swallowed(void)
+{
+    for (unsigned i = 0; i < app.tile_count; i++) {
+        if (app.tiles[i].type == TILE_TYPE_APP && app.tiles[i].window == 0) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+static void
+notify_parent(void)
+{
+    if (app.parent_pid == 0) {
+        return;
+    }
+
+    pm_debug("Notifying parent process %d", app.parent_pid);
+
+    app.platform->signal_process(app.parent_pid, SIGUSR1);
+    app.parent_pid = 0;
+}
+
+static void
+draw_placeholder(unsigned index)
+{
+    struct position pos = get_tile_position(index);
+    unsigned dot = app.tile_size / 16 > 2 ? app.tile_size / 16 : 2;
+    int x = pos.x + (app.tile_size - (PLACEHOLDER_DOTS * 2 - 1) * dot) / 2;
+    int y = pos.y + (app.tile_size - dot) / 2;
+
+    // Dockapps waiting for their turn to start show no active dot
+    for (unsigned i = 0; i < PLACEHOLDER_DOTS; i++) {
+        int active = app.tiles[index].started_at && i == app.placeholder_frame % PLACEHOLDER_DOTS;
+
+        XSetForeground(app.display, app.gc,
+            active ? WhitePixel(app.display, app.screen) : BlackPixel(app.display, app.screen));
+        XFillRectangle(app.display, app.dock_window, app.gc, x + i * dot * 2, y, dot, dot);
+    }
+}
+
+static void
+handle_placeholder_timer(void)
+{
+    int pending = 0;
+
+    app.placeholder_frame++;
+
+    for (unsigned i = 0; i < app.tile_count; i++) {
+        if (app.tiles[i].type == TILE_TYPE_APP && app.tiles[i].window == 0) {
+            app.tiles[i].dirty |= DIRTY_PLACEHOLDER;
+            pending = 1;
+        }
+    }
+
+    if (pending && app.profile->animations) {
+        set_timer(TIMER_PLACEHOLDER, PLACEHOLDER_INTERVAL_MS);
+    }
+}
+
+static void
+create_glyph_cache(void)
+{
+    XFontStruct *font = XLoadQueryFont(app.display, "fixed");
+    XColor color, exact;
+
+    if (font == NULL) {
+        pm_warn("Failed to load font for badges");
+        return;
+    }
+
+    // Recreating a released atlas keeps the color allocated the first time
+    if (app.glyphs.glyph_width == 0) {
+        app.glyphs.bg_pixel = BlackPixel(app.display, app.screen);
+
+        if (XAllocNamedColor(app.display, DefaultColormap(app.display, app.screen), "red3", &color, &exact)) {
+            app.glyphs.bg_pixel = color.pixel;
+        }
+    }
+
+    app.glyphs.ascent = font->ascent;
+    app.glyphs.glyph_width = font->max_bounds.width;
+    app.glyphs.glyph_height = font->ascent + font->descent;
+
+    // Rasterize all printable characters once, badges are then painted
+    // by copying glyphs from the atlas instead of rendering text.
+    unsigned count = GLYPH_LAST - GLYPH_FIRST + 1;
+
+    app.glyphs.atlas = XCreatePixmap(app.display, app.dock_window,
+        count * app.glyphs.glyph_width, app.glyphs.glyph_height,
+        DefaultDepth(app.display, app.screen));
+
+    XSetFont(app.display, app.gc, font->fid);
+    XSetForeground(app.display, app.gc, WhitePixel(app.display, app.screen));
+    XSetBackground(app.display, app.gc, app.glyphs.bg_pixel);
+
+    for (unsigned i = 0; i < count; i++) {
+        char c = GLYPH_FIRST + i;
+
+        XDrawImageString(app.display, app.glyphs.atlas, app.gc,
+            i * app.glyphs.glyph_width, app.glyphs.ascent, &c, 1);
+    }
+
+    XFreeFont(app.display, font);
+
+    pm_debug("Created glyph cache with %u glyphs of %ux%u",
+        count, app.glyphs.glyph_width, app.glyphs.glyph_height);
+}
+
+static int
+check_glyph_cache(void)
+{
+    // The atlas is released under memory pressure, and rasterized again when needed
+    if (app.glyphs.atlas == None && app.glyphs.glyph_width > 0) {
+        create_glyph_cache();
+    }
+
+    return app.glyphs.atlas != None;
+}
+
+static void
+set_badge(unsigned index, const char *text)
+{
+    struct tile *tile = &app.tiles[index];
+
+    if (strncmp(tile->badge, text, BADGE_MAX_LEN) == 0) {
+        return;
+    }
+
+    snprintf(tile->badge, sizeof(tile->badge), "%s", text);
+    tile->badge_dirty = 1;
+
+    // Coalesce rapid updates into at most one repaint per interval
+    if (app.timers[TIMER_BADGE] == 0) {
+        long long elapsed = get_time_ms() - app.badge_painted_at;
+        long long interval = app.profile->badge_interval_ms;
+        set_timer(TIMER_BADGE, elapsed < interval ? interval - elapsed : 0);
+    }
+}
+
+static void
+paint_badge(unsigned index)
+{
+    struct tile *tile = &app.tiles[index];
+    struct rect old = tile->badge_rect;
+    unsigned max_len = app.glyphs.glyph_width ? (app.tile_size - 2 * BADGE_PADDING) / app.glyphs.glyph_width : 0;
+    unsigned len = strlen(tile->badge);
+
+    if (len > max_len) {
+        len = max_len;
+    }
+
+    tile->badge_rect = (struct rect) { 0, 0, 0, 0 };
+
+    if (len > 0 && check_glyph_cache()) {
+        tile->badge_rect.width = len * app.glyphs.glyph_width + 2 * BADGE_PADDING;
+        tile->badge_rect.height = app.glyphs.glyph_height + 2 * BADGE_PADDING;
+        tile->badge_rect.x = app.tile_size - tile->badge_rect.width;
+    }
+
+    // Restore the part of the old badge not covered by the new one
+    if (old.width > tile->badge_rect.width || old.height > tile->badge_rect.height) {
+        XCopyArea(app.display, tile->pixmap, tile->window, app.gc,
+            old.x, old.y, old.width, old.height, old.x, old.y);
+    }
+
+    if (tile->badge_rect.width == 0) {
+        return;
+    }
+
+    XSetForeground(app.display, app.gc, app.glyphs.bg_pixel);
+    XFillRectangle(app.display, tile->window, app.gc, tile->badge_rect.x, tile->badge_rect.y,
+        tile->badge_rect.width, tile->badge_rect.height);
+
+    for (unsigned i = 0; i < len; i++) {
+        unsigned char c = tile->badge[i];
+        unsigned glyph = (c >= GLYPH_FIRST && c <= GLYPH_LAST ? c : '?') - GLYPH_FIRST;
+
+        XCopyArea(app.display, app.glyphs.atlas, tile->window, app.gc,
+            glyph * app.glyphs.glyph_width, 0, app.glyphs.glyph_width, app.glyphs.glyph_height,
+            tile->badge_rect.x + BADGE_PADDING + i * app.glyphs.glyph_width,
+            tile->badge_rect.y + BADGE_PADDING);
+    }
+}
+
+static void
+handle_badge_timer(void)
+{
+    for (unsigned i = 0; i < app.tile_count; i++) {
+        if (app.tiles[i].badge_dirty) {
+            app.tiles[i].badge_dirty = 0;
+            app.tiles[i].dirty |= DIRTY_BADGE;
+        }
+    }
+
+    app.badge_painted_at = get_time_ms();
+}
+
+static void
+count_tile_bytes(unsigned index, unsigned width, unsigned height)
+{
+    // Approximate pixel data drawn into the tile, assuming 32 bits per pixel
+    app.tiles[index].stats.bytes += (unsigned long long)width * height * 4;
+}
+
+static unsigned long long
+read_cpu_ticks(pid_t pid)
+{
+    char path[64];
+    unsigned long long utime = 0, stime = 0;
+    FILE *f;
+
+    snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+
+    if ((f = fopen(path, "r")) == NULL) {
+        return 0;
+    }
+
+    if (fscanf(f, "%*d (%*[^)]) %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu", &utime, &stime) != 2) {
+        utime = stime = 0;
+    }
+
+    fclose(f);
+
+    return utime + stime;
+}
+
+static void
+update_tile_stats(unsigned index, long long elapsed_ms)
+{
+    struct tile_stats *stats = &app.tiles[index].stats;
+
+    stats->repaint_avg_us = stats->repaint_count ? stats->repaint_us / stats->repaint_count : 0;
+    stats->repaint_count = 0;
+    stats->repaint_us = 0;
+
+    stats->damage_rate = stats->damage_count * 1000 / elapsed_ms;
+    stats->damage_count = 0;
+
+    if (app.tiles[index].type == TILE_TYPE_APP && app.tiles[index].pid > 0) {
+        unsigned long long ticks = read_cpu_ticks(app.tiles[index].pid);
+        unsigned long long delta = ticks > stats->cpu_ticks ? ticks - stats->cpu_ticks : 0;
+
+        stats->cpu_percent = delta * 100000 / sysconf(_SC_CLK_TCK) / elapsed_ms;
+        stats->cpu_ticks = ticks;
+    }
+}
+
+static void
+paint_hud(unsigned index)
+{
+    struct tile *tile = &app.tiles[index];
+    struct position pos = { 0, 0 };
+    Drawable drawable = tile->window;
+    char lines[HUD_LINES][32];
+    unsigned max_len = app.tile_size / app.glyphs.glyph_width;
+    unsigned line_count = app.tile_size / app.glyphs.glyph_height;
+    unsigned width = 0;
+
+    snprintf(lines[0], sizeof(lines[0]), "x%lu %lldus", tile->stats.exposes, tile->stats.repaint_avg_us);
+    snprintf(lines[1], sizeof(lines[1]), "%lluK", tile->stats.bytes / 1024);
+    lines[2][0] = '\0';
+
+    if (tile->type == TILE_TYPE_APP) {
+        snprintf(lines[2], sizeof(lines[2]), "d%u c%u%%", tile->stats.damage_rate, tile->stats.cpu_percent);
+    }
+
+    // Dockapps are painted through the dock window over their own windows
+    if (tile->type != TILE_TYPE_LAUNCHER) {
+        drawable = app.dock_window;
+        pos = get_tile_position(index);
+    }
+
+    if (line_count > HUD_LINES) {
+        line_count = HUD_LINES;
+    }
+
+    for (unsigned i = 0; i < line_count; i++) {
+        unsigned len = strlen(lines[i]);
+        width = len > width ? len : width;
+    }
+
+    // Pad lines to the previous width to cover stale digits
+    unsigned padded = width > tile->stats.hud_width ? width : tile->stats.hud_width;
+    tile->stats.hud_width = width;
+
+    if (padded > max_len) {
+        padded = max_len;
+    }
+
+    for (unsigned i = 0; i < line_count; i++) {
+        unsigned len = strlen(lines[i]);
+
+        for (unsigned j = 0; j < padded; j++) {
+            unsigned char c = j < len ? lines[i][j] : ' ';
+            unsigned glyph = (c >= GLYPH_FIRST && c <= GLYPH_LAST ? c : '?') - GLYPH_FIRST;
+
+            XCopyArea(app.display, app.glyphs.atlas, drawable, app.hud_gc,
+                glyph * app.glyphs.glyph_width, 0, app.glyphs.glyph_width, app.glyphs.glyph_height,
+                pos.x + j * app.glyphs.glyph_width, pos.y + i * app.glyphs.glyph_height);
+        }
+    }
+}
+
+static void
+handle_hud_timer(void)
+{
+    long long now = get_time_ms();
+    long long elapsed = now - app.hud_refreshed_at;
+
+    // Counters are only formatted and painted here, once per interval,
+    // so the overlay adds little to the work it measures
+    if (elapsed > 0 && check_glyph_cache()) {
+        for (unsigned i = 0; i < app.tile_count; i++) {
+            if (app.tiles[i].type != TILE_TYPE_TASKS) {
+                update_tile_stats(i, elapsed);
+                app.tiles[i].dirty |= DIRTY_HUD;
+            }
+        }
+
+        app.hud_refreshed_at = now;
+    }
+
+    set_timer(TIMER_HUD, HUD_INTERVAL_MS);
+}
+
+#ifdef USE_DAMAGE
+static void
+handle_damage_event(XEvent *event)
+{
+    XDamageNotifyEvent *damage_event = (XDamageNotifyEvent *)event;
+
+    for (unsigned i = 0; i < app.tile_count; i++) {
+        if (app.tiles[i].stats.damage == damage_event->damage) {
+            app.tiles[i].stats.damage_count++;
+            break;
+        }
+    }
+
+    // Report the next change only after this one has been counted
+    XDamageSubtract(app.display, damage_event->damage, None, None);
+}
+#endif
+
+static void
+handle_control_command(char *command, FILE *reply)
+{
+    char *saveptr = NULL;
+    const char *name = strtok_r(command, " \t\n", &saveptr);
+
+    if (name == NULL) {
+        return;
+    }
+
+    if (strcmp(name, "badge") == 0) {
+        const char *index_str = strtok_r(NULL, " \t\n", &saveptr);
+        const char *text = strtok_r(NULL, "\n", &saveptr);
+        char *end = NULL;
+        unsigned long index = index_str ? strtoul(index_str, &end, 10) : 0;
+
+        if (index_str == NULL || *end != '\0' || index >= app.tile_count
+            || app.tiles[index].type != TILE_TYPE_LAUNCHER) {
+            pm_warn("Invalid badge command, expected: badge LAUNCHER_INDEX [TEXT]");
+            return;
+        }
+
+        set_badge(index, text ? text : "");
+        return;
+    }
+
+    if (strcmp(name, "stats") == 0) {
+        print_launch_stats(reply);
+        print_footprint(reply);
+        return;
+    }
+
+    pm_warn("Unknown control command '%s'", name);
+}
+
+static void
+handle_control_socket(int fd)
+{
+    char buf[256];
+    struct sockaddr_un from;
+    socklen_t from_len = sizeof(from);
+    ssize_t len;
+
+    while ((len = recvfrom(fd, buf, sizeof(buf) - 1, MSG_DONTWAIT, (struct sockaddr *)&from, &from_len)) > 0) {
+        char *reply = NULL;
+        size_t reply_len = 0;
+        FILE *f = open_memstream(&reply, &reply_len);
+
+        buf[len] = '\0';
+        pm_debug("Received control command: %s", buf);
+
+        handle_control_command(buf, f);
+        fclose(f);
+
+        // Replies go back to the sender if it has an address, stderr otherwise
+        if (reply_len > 0) {
+            if (from_len > offsetof(struct sockaddr_un, sun_path) && from.sun_path[0] != '\0') {
+                sendto(fd, reply, reply_len, MSG_DONTWAIT, (struct sockaddr *)&from, from_len);
+            } else {
+                fputs(reply, stderr);
+            }
+        }
+
+        free(reply);
+        from_len = sizeof(from);
+    }
+}
+
+static void
+handle_memory_pressure(int fd)
+{
+    short revents = app.watches[WATCH_PRESSURE].revents;
+
+    // The trigger is gone, e.g. with the cgroup, and would keep polling as ready
+    if (revents & (POLLERR | POLLHUP | POLLNVAL)) {
+        pm_warn("Memory pressure trigger failed, no longer monitoring it");
+        close(fd);
+        app.watches[WATCH_PRESSURE].fd = -1;
+        return;
+    }
+
+    if (!(revents & POLLPRI)) {
+        return;
+    }
+
+    if (app.timers[TIMER_PRESSURE] == 0) {
+        pm_debug("Memory pressure detected, dropping image copies and the glyph atlas");
+
+        // Tiles are composed on the server, images and the atlas are recreated lazily if needed
+        free_image(&app.bg_image);
+
+        for (unsigned i = 0; i < app.tile_count; i++) {
+            free_image(&app.tiles[i].icon);
+        }
+
+        if (app.glyphs.atlas != None) {
+            XFreePixmap(app.display, app.glyphs.atlas);
+            app.glyphs.atlas = None;
+        }
+
+        image_set_cache(0);
+    }
+
+    set_timer(TIMER_PRESSURE, PRESSURE_RELIEF_MS);
+}
+
+static void
+handle_pressure_relief_timer(void)
+{
+    pm_debug("Memory pressure subsided");
+
+    image_set_cache(1);
+}
+
+static void
+set_frozen(unsigned reason, int frozen)
+{
+    unsigned old_reasons = app.freeze_reasons;
+
+    if (frozen) {
+        app.freeze_reasons |= reason;
+    } else {
+        app.freeze_reasons &= ~reason;
+    }
+
+    if (!old_reasons == !app.freeze_reasons) {
+        return;
+    }
+
+    pm_debug("%s dockapps", app.freeze_reasons ? "Freezing" : "Resuming");
+
+    // Dockapps still starting are left running, so they can be swallowed
+    for (unsigned i = 0; i < app.tile_count; i++) {
+        if (app.tiles[i].type == TILE_TYPE_APP && app.tiles[i].pid > 0 && app.tiles[i].window != 0) {
+            app.platform->signal_process(-app.tiles[i].pid, app.freeze_reasons ? SIGSTOP : SIGCONT);
+        }
+    }
+}
+
+static void
+set_dock_hidden(int hidden)
+{
+    if (app.dock_hidden == hidden) {
+        return;
+    }
+
+    pm_debug("Dock is %s", hidden ? "hidden" : "visible");
+
+    app.dock_hidden = hidden;
+    set_frozen(FREEZE_HIDDEN, hidden && app.profile->freeze_hidden);
+}
+
+static void
+set_timer_slack(pid_t pid, unsigned long slack_ns)
+{
+#ifdef __linux__
+    char path[64];
+
+    snprintf(path, sizeof(path), "/proc/%d/timerslack_ns", pid);
+
+    // Changing the slack of another process needs CAP_SYS_NICE, without it
+    // only dockapps started after switching profiles get it, through prctl
+    FILE *f = fopen(path, "w");
+    int ok = f != NULL && fprintf(f, "%lu", slack_ns) > 0;
+
+    // Write errors are only reported when the buffer is flushed
+    if (f != NULL && fclose(f) != 0) {
+        ok = 0;
+    }
+
+    if (!ok && !app.timer_slack_warned) {
+        pm_warn("Failed to set timer slack of running dockapps: %s", strerror(errno));
+        app.timer_slack_warned = 1;
+    }
+#else
+    (void)pid;
+    (void)slack_ns;
+#endif
+}
+
+static void
+apply_profile(const struct profile *profile)
+{
+    if (app.profile == profile) {
+        return;
+    }
+
+    pm_debug("Switching to %s power profile", profile->name);
+
+    app.profile = profile;
+
+    for (unsigned i = 0; i < app.tile_count; i++) {
+        if (app.tiles[i].type == TILE_TYPE_APP && app.tiles[i].pid > 0) {
+            set_timer_slack(app.tiles[i].pid, profile->timer_slack_ns);
+        }
+    }
+
+    set_frozen(FREEZE_HIDDEN, app.dock_hidden && profile->freeze_hidden);
+
+    if (profile->animations && !check_all_dockapps_swallowed()) {
+        set_timer(TIMER_PLACEHOLDER, PLACEHOLDER_INTERVAL_MS);
+    }
+}
+
+static int
+check_on_battery(void)
+{
+    DIR *dir = opendir("/sys/class/power_supply");
+    struct dirent *entry;
+    int mains = 0, online = 0;
+
+    if (dir == NULL) {
+        return 0;
+    }
+
+    while ((entry = readdir(dir)) != NULL) {
+        char path[512], type[32] = "";
+        int value = 0;
+        FILE *f;
+
+        if (entry->d_name[0] == '.') {
+            continue;
+        }
+
+        snprintf(path, sizeof(path), "/sys/class/power_supply/%s/type", entry->d_name);
+
+        if ((f = fopen(path, "r")) == NULL) {
+            continue;
+        }
+
+        int is_mains = fscanf(f, "%31s", type) == 1 && strcmp(type, "Mains") == 0;
+        fclose(f);
+
+        if (!is_mains) {
+            continue;
+        }
+
+        mains = 1;
+
+        snprintf(path, sizeof(path), "/sys/class/power_supply/%s/online", entry->d_name);
+
+        if ((f = fopen(path, "r")) != NULL) {
+            if (fscanf(f, "%d", &value) == 1 && value) {
+                online = 1;
+            }
+            fclose(f);
+        }
+    }
+
+    closedir(dir);
+
+    return mains && !online;
+}
+
+static void
+handle_power_event(int fd)
+{
+    char buf[4096];
+    ssize_t len;
+    int changed = 0;
+
+    // Uevents are sequences of NUL-terminated strings, e.g. SUBSYSTEM=power_supply
+    while ((len = recv(fd, buf, sizeof(buf) - 1, MSG_DONTWAIT)) > 0) {
+        buf[len] = '\0';
+
+        for (ssize_t i = 0; i < len; i += strlen(buf + i) + 1) {
+            if (strcmp(buf + i, "SUBSYSTEM=power_supply") == 0) {
+                changed = 1;
+            }
+        }
+    }
+
+    if (changed) {
+        apply_profile(&PROFILES[check_on_battery() ? PROFILE_BATTERY : PROFILE_AC]);
+    }
+}
+
+#ifdef USE_SCRNSAVER
+static void
+handle_screen_saver_event(const XEvent *event)
+{
+    const XScreenSaverNotifyEvent *saver_event = (const XScreenSaverNotifyEvent *)event;
+
+    pm_debug("Screen saver %s", saver_event->state == ScreenSaverOff ? "deactivated" : "activated");
+
+    set_frozen(FREEZE_IDLE, saver_event->state != ScreenSaverOff);
+
+    // The server activates the screen saver before switching the monitor off,
+    // and deactivates it on user activity, which switches the monitor back on
+    if (app.dpms_capable) {
+        app.dpms_check_ms = DPMS_CHECK_MIN_MS;
+        cancel_timer(TIMER_DPMS);
+        handle_dpms_timer();
+    }
+}
+#endif
+
+static void
+set_dpms_off(int off)
+{
+    int was_off = (app.freeze_reasons & FREEZE_DPMS) != 0;
+
+    set_frozen(FREEZE_DPMS, off);
+
+    // Badges and placeholders changed while frozen weren't painted
+    if (was_off && !off) {
+        for (unsigned i = 0; i < app.tile_count; i++) {
+            app.tiles[i].dirty |= DIRTY_TILE;
+        }
+
+        for (unsigned i = 0; i < app.task_count; i++) {
+            app.tasks[i].dirty = 1;
+        }
+    }
+}
+
+static void
+handle_dpms_timer(void)
+{
+    CARD16 power_level;
+    BOOL enabled;
+
+    if (!DPMSInfo(app.display, &power_level, &enabled)) {
+        return;
+    }
+
+    int off = enabled && power_level != DPMSModeOn;
+    int changed = off != ((app.freeze_reasons & FREEZE_DPMS) != 0);
+
+    set_dpms_off(off);
+
+    // With screen saver events, poll only while the saver is on and the monitor isn't off yet
+    if (app.saver_event_base >= 0 && (off || !(app.freeze_reasons & FREEZE_IDLE))) {
+        return;
+    }
+
+    if (changed) {
+        app.dpms_check_ms = DPMS_CHECK_MIN_MS;
+    }
+
+    set_timer(TIMER_DPMS, app.dpms_check_ms);
+
+    if (app.dpms_check_ms < DPMS_CHECK_MAX_MS) {
+        app.dpms_check_ms = app.dpms_check_ms * 2 < DPMS_CHECK_MAX_MS ? app.dpms_check_ms * 2 : DPMS_CHECK_MAX_MS;
+    }
+}
+
+static int
+check_own_window(Window window)
+{
+    if (window == app.dock_window) {
+        return 1;
+    }
+
+    for (unsigned i = 0; i < app.tile_count; i++) {
+        if (window == app.tiles[i].window) {
+            return 1;
+        }
+    }
+
+    for (unsigned i = 0; i < app.task_count; i++) {
+        if (window == app.tasks[i].window) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+static int
+check_window_state(Window window, Atom state)
+{
+    unsigned long nitems;
+    Atom *states = (Atom *)get_window_property(window, app.atoms[ATOM_NET_WM_STATE], XA_ATOM, 32, &nitems);
+    int found = 0;
+
+    for (unsigned long i = 0; i < nitems; i++) {
+        if (states[i] == state) {
+            found = 1;
+        }
+    }
+
+    if (states) {
+        XFree(states);
+    }
+
+    return found;
+}
+
+static int
+check_fullscreen_covering(void)
+{
+    if (app.active_window == None
+        || !check_window_state(app.active_window, app.atoms[ATOM_NET_WM_STATE_FULLSCREEN])) {
+        return 0;
+    }
+
+    // Only yield if the fullscreen window is on the dock's monitor. The dock's
+    // geometry is known, only the active window's size and position are queried.
+    struct size active = get_window_size(app.active_window);
+    struct size dock = get_dock_size();
+    Window child;
+    int active_x, active_y;
+
+    if (active.width == 0
+        || !XTranslateCoordinates(app.display, app.active_window, app.root_window, 0, 0, &active_x, &active_y, &child)) {
+        return 0;
+    }
+
+    return active_x < app.dock_pos.x + (int)dock.width && app.dock_pos.x < active_x + (int)active.width
+        && active_y < app.dock_pos.y + (int)dock.height && app.dock_pos.y < active_y + (int)active.height;
+}
+
+static void
+update_active_window(void)
+{
+    unsigned long nitems;
+    Window *data = (Window *)get_window_property(app.root_window, app.atoms[ATOM_NET_ACTIVE_WINDOW], XA_WINDOW, 1, &nitems);
+    Window active = data ? data[0] : None;
+
+    if (data) {
+        XFree(data);
+    }
+
+    if (active != app.active_window) {
+        pm_debug("Active window changed to 0x%lx", active);
+
+        // Don't clobber event masks of our own windows, or clients watched for tasks
+        if (app.active_window != None && !check_own_window(app.active_window)
+            && !check_task_client(app.active_window)) {
+            XSelectInput(app.display, app.active_window, 0);
+        }
+
+        app.active_window = check_own_window(active) ? None : active;
+
+        if (app.active_window != None) {
+            XSelectInput(app.display, app.active_window, PropertyChangeMask);
+        }
+    }
+
+    set_frozen(FREEZE_FULLSCREEN, check_fullscreen_covering());
+}
+
+static void
+handle_property_event(const XEvent *event)
+{
+    const XPropertyEvent *property = &event->xproperty;
+
+    if (app.fullscreen_yield && property->window == app.root_window && property->atom == app.atoms[ATOM_NET_ACTIVE_WINDOW]) {
+        update_active_window();
+    } else if (property->atom == app.atoms[ATOM_NET_WM_STATE]) {
+        if (property->window == app.active_window) {
+            set_frozen(FREEZE_FULLSCREEN, check_fullscreen_covering());
+        }
+
+        if (app.task_tile >= 0 && !check_own_window(property->window)) {
+            update_task_state(property->window);
+        }
+    } else if (property->window == app.root_window && property->atom == app.atoms[ATOM_NET_CLIENT_LIST]) {
+        update_client_list(1);
+    } else if (property->window == app.root_window && property->atom == app.atoms[ATOM_NET_CLIENT_LIST_STACKING]) {
+        // Without a WM keeping the dock on top, raise it after every restack
+        if (app.override_redirect && app.above_all && !(app.freeze_reasons & FREEZE_FULLSCREEN)) {
+            XRaiseWindow(app.display, app.dock_window);
+        }
+    } else if (property->atom == app.atoms[ATOM_NET_WM_ICON]) {
+        int index = find_task(property->window);
+
+        // Icons are only read again when they change
+        if (index >= 0) {
+            compose_task(index);
+            app.tasks[index].dirty = 1;
+        }
+    }
+}
+
+static int
+check_task_client(Window client)
+{
+    // Tasks are watched for changes, and clients skipping the taskbar in case they stop
+    return app.task_tile >= 0 && (find_task(client) >= 0 || check_skip_taskbar(client));
+}
+
+static void
+update_task_state(Window client)
+{
+    int index = find_task(client);
+
+    // Clients may start or stop skipping the taskbar at any time
+    if ((index >= 0) != check_skip_taskbar(client)) {
+        return;
+    }
+
+    if (index >= 0) {
+        app.tasks[index].skipped = 1;
+    }
+
+    update_client_list(0);
+}
+
+static int
+check_launch_pending(void)
+{
+    for (unsigned i = 0; i < app.tile_count; i++) {
+        if (app.tiles[i].launch_pid > 0) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+static void
+update_client_list(int check_new)
+{
+    unsigned long nitems = 0;
+    Window *clients = NULL;
+
+    if (app.task_tile >= 0 || check_launch_pending()) {
+        clients = (Window *)get_window_property(app.root_window, app.atoms[ATOM_NET_CLIENT_LIST],
+            XA_WINDOW, 65536, &nitems);
+    }
+
+    // Only windows which weren't in the list before can belong to a launch
+    check_new = check_new && check_launch_pending();
+
+    for (unsigned long i = 0; check_new && i < nitems; i++) {
+        int known = 0;
+
+        for (unsigned long j = 0; j < app.client_count && !known; j++) {
+            known = clients[i] == app.client_list[j];
+        }
+
+        if (!known) {
+            check_launched_window(clients[i]);
+        }
+    }
+
+    if (app.task_tile >= 0) {
+        update_tasks(clients, nitems);
+    }
+
+    if (app.client_list) {
+        XFree(app.client_list);
+    }
+
+    app.client_list = clients;
+    app.client_count = nitems;
+
+    if (!check_launch_pending() && app.client_list) {
+        XFree(app.client_list);
+        app.client_list = NULL;
+        app.client_count = 0;
+    }
+
+    update_root_events();
+}
+
+static pid_t
+get_parent_pid(pid_t pid)
+{
+    char path[64];
+    pid_t ret = 0;
+    FILE *f;
+
+    // Commands not exec'd directly by the shell run as its children
+    snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+
+    if ((f = fopen(path, "r")) == NULL) {
+        return 0;
+    }
+
+    if (fscanf(f, "%*d (%*[^)]) %*c %d", &ret) != 1) {
+        ret = 0;
+    }
+
+    fclose(f);
+
+    return ret;
+}
+
+static void
+record_launch_latency(unsigned index)
+{
+    struct tile *tile = &app.tiles[index];
+    long long latency = get_time_ms() - tile->launched_at;
+    unsigned bucket = 0;
+
+    while (bucket < LATENCY_BUCKETS - 1 && (1LL << (bucket + 1)) <= latency) {
+        bucket++;
+    }
+
+    tile->latency_hist[bucket]++;
+    tile->latency_total_ms += latency;
+    tile->launch_pid = 0;
+
+    pm_debug("Launcher %s showed its first window after %lld ms", tile->command, latency);
+}
+
+static void
+check_launched_window(Window window)
+{
+    unsigned long nitems;
+    unsigned long *data = (unsigned long *)get_window_property(window, app.atoms[ATOM_NET_WM_PID], XA_CARDINAL, 1, &nitems);
+
+    if (data == NULL) {
+        return;
+    }
+
+    pid_t pid = (pid_t)data[0];
+    pid_t parent_pid = get_parent_pid(pid);
+
+    XFree(data);
+
+    for (unsigned i = 0; i < app.tile_count; i++) {
+        pid_t launch_pid = app.tiles[i].launch_pid;
+
+        if (launch_pid > 0 && (pid == launch_pid || parent_pid == launch_pid)) {
+            record_launch_latency(i);
+            break;
+        }
+    }
+}
+
+static void
+handle_launch_timer(void)
+{
+    long long now = get_time_ms();
+    long long next = 0;
+
+    for (unsigned i = 0; i < app.tile_count; i++) {
+        struct tile *tile = &app.tiles[i];
+
+        if (tile->launch_pid == 0) {
+            continue;
+        }
+
+        if (now - tile->launched_at >= LAUNCH_TIMEOUT_MS) {
+            pm_debug("Launcher %s showed no window, not tracking it anymore", tile->command);
+            tile->launch_pid = 0;
+        } else if (next == 0 || tile->launched_at + LAUNCH_TIMEOUT_MS < next) {
+            next = tile->launched_at + LAUNCH_TIMEOUT_MS;
+        }
+    }
+
+    if (next) {
+        set_timer(TIMER_LAUNCH, next - now);
+    } else {
+        update_client_list(0);
+    }
+}
+
+static void
+print_launch_stats(FILE *f)
+{
+    for (unsigned i = 0; i < app.tile_count; i++) {
+        struct tile *tile = &app.tiles[i];
+        unsigned count = 0;
+
+        if (tile->type != TILE_TYPE_LAUNCHER) {
+            continue;
+        }
+
+        for (unsigned j = 0; j < LATENCY_BUCKETS; j++) {
+            count += tile->latency_hist[j];
+        }
+
+        fprintf(f, "launcher %u (%s): %u launches", i, tile->command, count);
+
+        if (count > 0) {
+            fprintf(f, ", mean %lld ms,", tile->latency_total_ms / count);
+        }
+
+        for (unsigned j = 0; j < LATENCY_BUCKETS; j++) {
+            if (tile->latency_hist[j] > 0) {
+                fprintf(f, " %lld-%lldms:%u", j ? 1LL << j : 0, (1LL << (j + 1)) - 1, tile->latency_hist[j]);
+            }
+        }
+
+        fprintf(f, "\n");
+    }
+}
+
+static void
+schedule_swallow(unsigned index, unsigned stage, long long delay_ms)
+{
+    app.tiles[index].swallow_stage = stage;
+    app.tiles[index].swallow_at = get_time_ms() + delay_ms;
+
+    if (app.timers[TIMER_SWALLOW] == 0 || app.tiles[index].swallow_at < app.timers[TIMER_SWALLOW]) {
+        set_timer(TIMER_SWALLOW, delay_ms);
+    }
+}
+
+static int
+find_dockapp_tile(const char *res_name)
+{
+    // With -j, another tile with the same res_name may not be started yet
+    for (unsigned i = 0; i < app.tile_count; ++i) {
+        if (app.tiles[i].window == 0 && app.tiles[i].swallow_stage == SWALLOW_IDLE && app.tiles[i].started_at != 0
+            && app.tiles[i].res_name && !strcmp(res_name, app.tiles[i].res_name)) {
+            return (int)i;
+        }
+    }
+
+    return -1;
+}
+
+static void
+swallow_dockapp(Window main_window, int index)
+{
+    pm_debug("Swallowing dockapp with main window 0x%lx at index %d", main_window, index);
+
+    struct tile *tile = &app.tiles[index];
+
+    tile->swallow_main = main_window;
+    tile->swallow_icon = None;
+    tile->swallow_attempts = 0;
+    tile->swallow_wm = app.platform->check_window_manager();
+
+    // With an override-redirect dock, keep the WM away from dockapps too
+    if (tile->swallow_wm && app.override_redirect && app.platform->bypass_window_manager(main_window)) {
+        pm_debug("Bypassed window manager for window 0x%lx", main_window);
+        tile->swallow_wm = 0;
+    }
+
+    if (tile->swallow_wm) {
+        pm_warn("Window manager detected, swallowing dockapp with workaround");
+
+        // Give the WM time to handle the new window
+        schedule_swallow(index, SWALLOW_ICON, 100);
+        return;
+    }
+
+    tile->swallow_stage = SWALLOW_ICON;
+    advance_swallow(index);
+}
+
+static void
+advance_swallow(unsigned index)
+{
+    struct tile *tile = &app.tiles[index];
+
+    // Each stage either completes the swallow or schedules the next one,
+    // so the event loop keeps running while the WM processes our requests
+    switch (tile->swallow_stage) {
+    case SWALLOW_ICON:
+        tile->swallow_icon = app.platform->get_icon_window(tile->swallow_main);
+
+        if (tile->swallow_icon != None) {
+            if (app.override_redirect) {
+                app.platform->bypass_window_manager(tile->swallow_icon);
+            }
+
+            break;
+        }
+
+        if (++tile->swallow_attempts < SWALLOW_ICON_ATTEMPTS) {
+            pm_debug("Waiting for icon window of 0x%lx", tile->swallow_main);
+            schedule_swallow(index, SWALLOW_ICON, 100);
+        } else {
+            pm_warn("Window 0x%lx has no icon window, skipping", tile->swallow_main);
+            tile->swallow_stage = SWALLOW_IDLE;
+        }
+
+        return;
+    case SWALLOW_UNMAPPED:
+        app.platform->reparent_window(tile->swallow_main, tile->swallow_main_pos);
+        app.platform->reparent_window(tile->swallow_icon, tile->swallow_icon_pos);
+        schedule_swallow(index, SWALLOW_REPARENTED, 50);
+        return;
+    case SWALLOW_REPARENTED:
+        finish_swallow(index);
+        return;
+    default:
+        return;
+    }
+
+    app.platform->set_border_width(tile->swallow_icon, 0);
+
+    struct size size = app.platform->get_window_size(tile->swallow_icon);
+    struct position tile_pos = get_tile_position(index);
+
+    tile->swallow_icon_pos.x = tile_pos.x + (app.tile_size - size.width) / 2;
+    tile->swallow_icon_pos.y = tile_pos.y + (app.tile_size - size.height) / 2;
+    tile->swallow_main_pos.x = app.horizontal ? tile->swallow_icon_pos.x : (int)app.tile_size * 2;
+    tile->swallow_main_pos.y = app.horizontal ? (int)app.tile_size * 2 : tile->swallow_icon_pos.y;
+
+    if (tile->swallow_wm) {
+        // Unmap/reparent windows and give the WM time to process it.
+        app.platform->unmap_window(tile->swallow_main);
+        app.platform->unmap_window(tile->swallow_icon);
+        schedule_swallow(index, SWALLOW_UNMAPPED, 50);
+        return;
+    }
+
+    finish_swallow(index);
+}
+
+static void
+finish_swallow(unsigned index)
+{
+    struct tile *tile = &app.tiles[index];
+
+    app.platform->reparent_window(tile->swallow_main, tile->swallow_main_pos);
+    app.platform->reparent_window(tile->swallow_icon, tile->swallow_icon_pos);
+
+    app.platform->map_window(tile->swallow_main);
+    app.platform->map_window(tile->swallow_icon);
+
+    tile->window = tile->swallow_icon;
+    tile->swallow_stage = SWALLOW_IDLE;
+
+    // Icon windows smaller than the tile would leave placeholder dots around them
+    tile->dirty |= DIRTY_TILE;
+
+#ifdef USE_DAMAGE
+    if (app.damage_event_base >= 0) {
+        tile->stats.damage = XDamageCreate(app.display, tile->window, XDamageReportNonEmpty);
+    }
+#endif
+
+    pm_debug("Swallowed window 0x%lx at %ux%u, %lld ms after starting the dockapp",
+        tile->window, tile->swallow_icon_pos.x, tile->swallow_icon_pos.y, get_time_ms() - tile->started_at);
+
+    if (app.freeze_reasons && tile->pid > 0) {
+        app.platform->signal_process(-tile->pid, SIGSTOP);
+    }
+
+    if (check_all_dockapps_swallowed()) {
+        pm_debug("All dockapps swallowed %lld ms after startup", get_time_ms() - app.started_at);
+
+        update_root_events();
+        cancel_timer(TIMER_PLACEHOLDER);
+        notify_parent();
+    }
+
+    start_pending_dockapps();
+}
+
+static void
+handle_swallow_timer(void)
+{
+    long long next = 0;
+
+    for (unsigned i = 0; i < app.tile_count; i++) {
+        struct tile *tile = &app.tiles[i];
+
+        if (tile->swallow_stage != SWALLOW_IDLE && tile->swallow_at <= get_time_ms()) {
+            advance_swallow(i);
+        }
+
+        if (tile->swallow_stage != SWALLOW_IDLE && (next == 0 || tile->swallow_at < next)) {
+            next = tile->swallow_at;
+        }
+    }
+
+    if (next) {
+        long long now = get_time_ms();
+        set_timer(TIMER_SWALLOW, next > now ? next - now : 0);
+    }
+}
+
+static void
+handle_sigusr1(int signo)
+{
+    (void)signo; // Unused parameter
+
+    pm_debug("Exiting parent process");
+
+    exit(0);
+}
+
+static void
+handle_sigchld(int signo)
+{
+    (void)signo; // Unused parameter
+
+    // The child failed before the dock was ready
+    exit(1);
+}
+
+static void
+handle_sigterm(int signo)
+{
+    (void)signo; // Unused parameter
+
+    terminate_dockapps();
+
+    exit(0);
+}
+
+static void
+create_child_pipe(void)
+{
+    pm_assert(pipe(app.child_pipe) == 0, "Failed to create pipe");
+
+    for (unsigned i = 0; i < 2; i++) {
+        fcntl(app.child_pipe[i], F_SETFD, FD_CLOEXEC);
+        fcntl(app.child_pipe[i], F_SETFL, O_NONBLOCK);
+    }
+
+    app.watches[WATCH_CHILD].fd = app.child_pipe[0];
+}
+
+static void
+handle_child_signal(int signo)
+{
+    (void)signo; // Unused parameter
+
+    int saved_errno = errno;
+
+    // Children are reaped from the event loop. The pipe wakes up poll even
+    // when the signal arrives after the flag was checked, but before polling.
+    app.child_exited = 1;
+
+    if (app.child_pipe[1] >= 0 && write(app.child_pipe[1], "", 1) < 0) {
+        // The pipe is full, so poll wakes up anyway
+    }
+
+    errno = saved_errno;
+}
+
+static void
+handle_child_pipe(int fd)
+{
+    char buf[64];
+
+    while (read(fd, buf, sizeof(buf)) > 0) { }
+
+    reap_children();
+}
+
+static void
+reap_children(void)
+{
+    int status;
+    pid_t pid;
+
+    app.child_exited = 0;
+
+    while ((pid = app.platform->wait_child(&status)) > 0) {
+        app.child_count--;
+
+        for (unsigned i = 0; i < app.tile_count; i++) {
+            if (app.tiles[i].pid == pid) {
+                // Forget the pid, so it's never signalled after being reused
+                pm_warn("Dockapp %s exited with status %d", app.tiles[i].command,
+                    WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status));
+                app.tiles[i].pid = 0;
+            }
+        }
+    }
+}
+
+static int
+signal_process(pid_t pid, int signo)
+{
+    return kill(pid, signo);
+}
+
+static pid_t
+spawn_process(const char *command)
+{
+    pid_t pid = fork();
+
+    if (pid == 0) {
+        // Own process group, so the whole dockapp can be frozen at once
+        setpgid(0, 0);
+
+        restore_inherited_nice(command);
+
+#ifdef __linux__
+        if (app.profile->timer_slack_ns > 0) {
+            prctl(PR_SET_TIMERSLACK, app.profile->timer_slack_ns);
+        }
+#endif
+
+        execl("/bin/sh", "/bin/sh", "-c", command, (char *)NULL);
+        _exit(1);
+    }
+
+    if (pid > 0) {
+        setpgid(pid, pid);
+    }
+
+    return pid;
+}
+
+static pid_t
+wait_child(int *status)
+{
+    return waitpid(-1, status, WNOHANG);
+}
+
+static unsigned
+count_open_fds(void)
+{
+    DIR *dir = opendir("/proc/self/fd");
+    unsigned count = 0;
+    struct dirent *entry;
+
+    if (dir == NULL) {
+        return 0;
+    }
+
+    while ((entry = readdir(dir)) != NULL) {
+        count += entry->d_name[0] != '.';
+    }
+
+    closedir(dir);
+
+    // Don't count the descriptor of the directory itself
+    return count > 0 ? count - 1 : 0;
+}
+
+static void
+print_footprint(FILE *f)
+{
+    unsigned long rss_pages = 0;
+    unsigned pixmaps = (app.bg_pixmap != None) + (app.glyphs.atlas != None);
+    unsigned images = app.bg_image != NULL;
+    FILE *statm = fopen("/proc/self/statm", "r");
+
+    if (statm != NULL) {
+        if (fscanf(statm, "%*u %lu", &rss_pages) != 1) {
+            rss_pages = 0;
+        }
+
+        fclose(statm);
+    }
+
+    for (unsigned i = 0; i < app.tile_count; i++) {
+        images += app.tiles[i].icon != NULL;
+    }
+
+    for (struct shared_pixmap *shared = app.pixmaps; shared; shared = shared->next) {
+        pixmaps++;
+    }
+
+    fprintf(f, "footprint: rss %lu KiB, locked %lu KiB, fds %u, children %u, pixmaps %u, images %u\n",
+        rss_pages * (sysconf(_SC_PAGESIZE) / 1024), read_locked_kib(), count_open_fds(), app.child_count,
+        pixmaps, images);
+}
+
+static unsigned long
+read_locked_kib(void)
+{
+    char line[128];
+    unsigned long locked = 0;
+    FILE *f = fopen("/proc/self/status", "r");
+
+    if (f == NULL) {
+        return 0;
+    }
+
+    while (fgets(line, sizeof(line), f)) {
+        if (sscanf(line, "VmLck: %lu", &locked) == 1) {
+            break;
+        }
+    }
+
+    fclose(f);
+
+    return locked;
+}
+
+static void
+prefault_stack(void)
+{
+    volatile char stack[PREFAULT_STACK_SIZE];
+
+    for (size_t i = 0; i < sizeof(stack); i += 256) {
+        stack[i] = 0;
+    }
+}
+
+static void
+lock_dock_memory(void)
+{
+    // Everything the event loop touches is mapped by now, lock it so the
+    // first click after a long idle period doesn't wait for swap-in.
+    // New mappings aren't locked, they could exceed RLIMIT_MEMLOCK.
+    prefault_stack();
+
+    if (mlockall(MCL_CURRENT) != 0) {
+        pm_warn("Failed to lock memory: %s (see ulimit -l)", strerror(errno));
+        return;
+    }
+
+    pm_debug("Locked %lu KiB of memory", read_locked_kib());
+}
+
+static void
+read_inherited_nice(void)
+{
+    // getpriority can return -1 on success
+    errno = 0;
+    app.inherited_nice = getpriority(PRIO_PROCESS, 0);
+
+    if (errno != 0) {
+        pm_warn("Failed to read nice level: %s", strerror(errno));
+        app.nice_level = 0;
+    }
+}
+
+static void
+restore_inherited_nice(const char *command)
+{
+    // Don't pass the dock's priority on to dockapps and launched applications,
+    // although lowering it back needs privileges when -N was positive
+    if (app.nice_level != 0 && setpriority(PRIO_PROCESS, 0, app.inherited_nice) != 0) {
+        pm_warn("Failed to restore nice level %d for %s: %s", app.inherited_nice, command, strerror(errno));
+    }
+}
+
+static void
+raise_priority(void)
+{
+    if (setpriority(PRIO_PROCESS, 0, app.nice_level) != 0) {
+        pm_warn("Failed to set nice level %d: %s", app.nice_level, strerror(errno));
+        app.nice_level = 0;
+        return;
+    }
+
+    pm_debug("Changed nice level from %d to %d", app.inherited_nice, app.nice_level);
+}
+
+static int
+handle_error_event(Display *display, XErrorEvent *error)
 {
     char error_text[256];
 
-    // Ignore BadWindow errors
-    if (error->request_code == 20) {
-        return 0;
+    // Ignore BadWindow errors
+    if (error->request_code == 20) {
+        return 0;
+    }
+
+    XGetErrorText(display, error->error_code, error_text, sizeof(error_text));
+
+    pm_debug("X11 Error (%d, %d, 0x%lx): %s",
+        error->request_code, error->minor_code, error->resourceid, error_text);
+
+    return 0;
+}
+
+static int
+handle_io_error_event(Display *display)
+{
+    (void)display;
+
+    pm_debug("X11 IO Error");
+
+    terminate_dockapps();
+
+    exit(1);
+}
+
+static void
+handle_create_event(const XEvent *event)
+{
+    Window window = event->xcreatewindow.window;
+    XClassHint class_hint;
+
+    // Menus and tooltips can't be dockapps, save a round trip for them
+    if (event->xcreatewindow.override_redirect) {
+        return;
+    }
+
+    if (!XGetClassHint(app.display, window, &class_hint)) {
+        return;
+    }
+
+    pm_debug("Created window 0x%lx with res_name '%s'", window, class_hint.res_name);
+
+    int index = find_dockapp_tile(class_hint.res_name);
+
+    if (index >= 0) {
+        swallow_dockapp(window, index);
+    }
+
+    XFree(class_hint.res_name);
+    XFree(class_hint.res_class);
+}
+
+static void
+handle_button_press_event(const XEvent *event)
+{
+    for (unsigned i = 0; i < app.tile_count; i++) {
+        if (app.tiles[i].type == TILE_TYPE_LAUNCHER && event->xbutton.window == app.tiles[i].window) {
+            pid_t pid = fork();
+
+            if (pid == 0) {
+                restore_inherited_nice(app.tiles[i].command);
+
+                execl("/bin/sh", "/bin/sh", "-c", app.tiles[i].command, (char *)NULL);
+                pm_warn("Failed to execute %s", app.tiles[i].command);
+                _exit(1);
+            }
+
+            if (pid < 0) {
+                pm_warn("Failed to fork launcher %s", app.tiles[i].command);
+                break;
+            }
+
+            app.child_count++;
+
+            // Track the launch until its first top-level window appears
+            int tracking = check_launch_pending();
+
+            app.tiles[i].launch_pid = pid;
+            app.tiles[i].launched_at = get_time_ms();
+
+            if (!tracking) {
+                update_client_list(0);
+                set_timer(TIMER_LAUNCH, LAUNCH_TIMEOUT_MS);
+            }
+
+            break;
+        }
+    }
+
+    for (unsigned i = 0; i < app.task_count; i++) {
+        if (event->xbutton.window == app.tasks[i].window) {
+            activate_task(i);
+            break;
+        }
+    }
+}
+
+static void
+handle_expose_event(const XExposeEvent *expose)
+{
+    // Only mark tiles, they are repainted once after all pending events
+    for (unsigned i = 0; i < app.tile_count; i++) {
+        struct position pos = get_tile_position(i);
+
+        if (expose->window == app.dock_window && app.tiles[i].type == TILE_TYPE_APP) {
+            if (expose->x >= pos.x + (int)app.tile_size || pos.x >= expose->x + expose->width
+                || expose->y >= pos.y + (int)app.tile_size || pos.y >= expose->y + expose->height) {
+                continue;
+            }
+        } else if (expose->window != app.tiles[i].window || app.tiles[i].type != TILE_TYPE_LAUNCHER) {
+            continue;
+        }
+
+        app.tiles[i].dirty |= DIRTY_TILE;
+        app.tiles[i].stats.exposes++;
+    }
+
+    for (unsigned i = 0; i < app.task_count; i++) {
+        if (expose->window == app.tasks[i].window) {
+            app.tasks[i].dirty = 1;
+            break;
+        }
+    }
+}
+
+static void
+paint_tile(unsigned index)
+{
+    struct tile *tile = &app.tiles[index];
+    struct position pos = get_tile_position(index);
+
+    if (tile->type == TILE_TYPE_APP) {
+        XCopyArea(app.display, app.bg_pixmap, app.dock_window, app.gc,
+            0, 0, app.tile_size, app.tile_size, pos.x, pos.y);
+
+        if (tile->window == 0) {
+            draw_placeholder(index);
+        }
+    } else if (tile->type == TILE_TYPE_LAUNCHER) {
+        XCopyArea(app.display, tile->pixmap, tile->window, app.gc,
+            0, 0, app.tile_size, app.tile_size, 0, 0);
+
+        tile->badge_rect = (struct rect) { 0, 0, 0, 0 };
+        paint_badge(index);
+    }
+
+    count_tile_bytes(index, app.tile_size, app.tile_size);
+}
+
+static void
+paint_dirty_tiles(void)
+{
+    for (unsigned i = 0; i < app.tile_count; i++) {
+        struct tile *tile = &app.tiles[i];
+        unsigned dirty = tile->dirty & ~DIRTY_HUD;
+
+        if (dirty == 0) {
+            continue;
+        }
+
+        tile->dirty &= DIRTY_HUD;
+
+        // A full repaint includes the badge and placeholder, and covers the overlay.
+        // Only full repaints are counted, badges and placeholders are much cheaper.
+        if (dirty & DIRTY_TILE) {
+            long long started_us = get_time_us();
+
+            paint_tile(i);
+
+            tile->stats.repaint_count++;
+            tile->stats.repaint_us += get_time_us() - started_us;
+
+            if (app.hud && tile->type != TILE_TYPE_TASKS) {
+                tile->dirty |= DIRTY_HUD;
+            }
+        } else {
+            if ((dirty & DIRTY_BADGE) && tile->type == TILE_TYPE_LAUNCHER) {
+                paint_badge(i);
+            }
+
+            if ((dirty & DIRTY_PLACEHOLDER) && tile->type == TILE_TYPE_APP && tile->window == 0) {
+                draw_placeholder(i);
+            }
+        }
+    }
+
+    // The overlay goes on top of everything painted above
+    for (unsigned i = 0; i < app.tile_count; i++) {
+        if ((app.tiles[i].dirty & DIRTY_HUD) && check_glyph_cache()) {
+            paint_hud(i);
+        }
+
+        app.tiles[i].dirty &= ~DIRTY_HUD;
+    }
+
+    for (unsigned i = 0; i < app.task_count; i++) {
+        if (app.tasks[i].dirty) {
+            app.tasks[i].dirty = 0;
+
+            // Tasks not composed yet show just the background
+            XCopyArea(app.display, app.tasks[i].pixmap != None ? app.tasks[i].pixmap : app.bg_pixmap,
+                app.tasks[i].window, app.gc, 0, 0, app.tile_size, app.tile_size, 0, 0);
+        }
+    }
+}
+
+#ifdef USE_RANDR
+static void
+handle_screen_change_event(XEvent *event)
+{
+    XRRUpdateConfiguration(event);
+
+    pm_debug("Screen configuration changed");
+
+    move_dock_window();
+}
+#endif
+
+static void
+parse_opts(int argc, char *argv[])
+{
+    int opt;
+    const char *pending_command = NULL;
+    const char *pending_icon = NULL;
+    const char *pending_resname = NULL;
+    unsigned current_tile = 0;
+    int pending_priority = 0;
+    const char *optstring = "aAb:Bc:D:dEFf:g:HhIi:j:L:l:MN:Oo:p:S:s:t:r:vWx:y:";
+
+    // First pass: count tiles
+    optind = 1;
+    while ((opt = getopt(argc, argv, optstring)) != -1) {
+        if (opt == 't') {
+            ++app.tile_count;
+        }
+    }
+
+    if (app.tile_count > 0) {
+        app.tiles = calloc(app.tile_count, sizeof(struct tile));
+        pm_assert(app.tiles != NULL, "Failed to allocate memory");
+    }
+
+    // Second pass: process arguments
+    optind = 1;
+    while ((opt = getopt(argc, argv, optstring)) != -1) {
+        switch (opt) {
+        case 'A':
+            app.above_all = 1;
+            break;
+        case 'a':
+            app.all_desktops = 1;
+            break;
+        case 'v':
+            app.verbose = 1;
+            break;
+        case 'x':
+            app.initial_x = atoi(optarg);
+            break;
+        case 'y':
+            app.initial_y = atoi(optarg);
+            break;
+        case 'o':
+            app.output_name = optarg;
+            break;
+        case 'g':
+            if (strcmp(optarg, "nw") == 0) {
+                app.gravity = 0;
+            } else if (strcmp(optarg, "ne") == 0) {
+                app.gravity = GRAVITY_EAST;
+            } else if (strcmp(optarg, "sw") == 0) {
+                app.gravity = GRAVITY_SOUTH;
+            } else if (strcmp(optarg, "se") == 0) {
+                app.gravity = GRAVITY_EAST | GRAVITY_SOUTH;
+            } else {
+                pm_error("Error: invalid gravity '%s' (must be nw, ne, sw or se)", optarg);
+                exit_usage(1);
+            }
+            break;
+        case 's': {
+            int size = atoi(optarg);
+            if (size <= 0) {
+                pm_error("Invalid tile size: %s", optarg);
+                exit_usage(1);
+            }
+            app.tile_size = size;
+            break;
+        }
+        case 'H':
+            app.horizontal = 1;
+            break;
+        case 'O':
+            app.hud = 1;
+            break;
+        case 'M':
+            app.lock_memory = 1;
+            break;
+        case 'W':
+            app.override_redirect = 1;
+            break;
+        case 'N': {
+            char *end = NULL;
+            long level = strtol(optarg, &end, 10);
+
+            if (*end != '\0' || level < -20 || level > 19 || level == 0) {
+                pm_error("Invalid nice level: %s", optarg);
+                exit_usage(1);
+            }
+
+            app.nice_level = level;
+            break;
+        }
+        case 'r':
+            pending_resname = optarg;
+            break;
+        case 'i':
+            pending_icon = optarg;
+            break;
+        case 'c':
+            pending_command = optarg;
+            break;
+        case 'p': {
+            char *end = NULL;
+            long priority = strtol(optarg, &end, 10);
+
+            if (end == optarg || *end != '\0' || priority < INT_MIN || priority > INT_MAX) {
+                pm_error("Invalid priority: %s", optarg);
+                exit_usage(1);
+            }
+
+            pending_priority = priority;
+            break;
+        }
+        case 'j': {
+            char *end = NULL;
+            long jobs = strtol(optarg, &end, 10);
+
+            if (end == optarg || *end != '\0' || jobs < 0 || jobs > INT_MAX) {
+                pm_error("Invalid number of jobs: %s", optarg);
+                exit_usage(1);
+            }
+
+            app.max_jobs = jobs;
+            break;
+        }
+        case 'l': {
+            char *end = NULL;
+            double load = strtod(optarg, &end);
+
+            // Also rejects NaN
+            if (end == optarg || *end != '\0' || !(load >= 0)) {
+                pm_error("Invalid load average: %s", optarg);
+                exit_usage(1);
+            }
+
+            app.max_load = load;
+            break;
+        }
+        case 'L': {
+            char *end = NULL;
+            double pressure = strtod(optarg, &end);
+
+            if (end == optarg || *end != '\0' || !(pressure >= 0 && pressure <= 100)) {
+                pm_error("Invalid CPU pressure: %s", optarg);
+                exit_usage(1);
+            }
+
+            app.max_cpu_pressure = pressure;
+            break;
+        }
+        case 'B':
+            app.power_profiles = 1;
+            break;
+        case 'I':
+            app.idle_freeze = 1;
+            break;
+        case 'F':
+            app.fullscreen_yield = 1;
+            break;
+        case 't':
+            if (strcmp(optarg, "tasks") == 0) {
+                if (app.task_tile >= 0) {
+                    pm_error("Error: only one tasks group is allowed");
+                    exit_usage(1);
+                }
+
+                app.tiles[current_tile].type = TILE_TYPE_TASKS;
+                app.task_tile = current_tile;
+            } else if (!pending_command) {
+                pm_error("Error: -t requires preceding -c to specify command");
+                exit_usage(1);
+            } else if (strcmp(optarg, "dockapp") == 0) {
+                if (!pending_resname) {
+                    pm_error("Error: dockapp type requires preceding -r to specify resource name");
+                    exit_usage(1);
+                }
+
+                app.tiles[current_tile].type = TILE_TYPE_APP;
+                app.tiles[current_tile].command = pending_command;
+                app.tiles[current_tile].res_name = pending_resname;
+                app.tiles[current_tile].priority = pending_priority;
+            } else if (strcmp(optarg, "launcher") == 0) {
+                if (!pending_icon) {
+                    pm_error("Error: launcher type requires preceding -i to specify icon");
+                    exit_usage(1);
+                }
+
+                app.tiles[current_tile].type = TILE_TYPE_LAUNCHER;
+                app.tiles[current_tile].command = pending_command;
+                app.tiles[current_tile].icon_path = pending_icon;
+            } else {
+                pm_error("Error: invalid type '%s' (must be 'dockapp', 'launcher' or 'tasks')", optarg);
+                exit_usage(1);
+            }
+
+            current_tile++;
+
+            pending_command = NULL;
+            pending_icon = NULL;
+            pending_resname = NULL;
+            pending_priority = 0;
+
+            break;
+        case 'b':
+            app.bg_path = optarg;
+            break;
+        case 'S':
+            app.control_path = optarg;
+            break;
+        case 'd':
+            app.daemon_mode = 1;
+            break;
+        case 'E':
+            app.early_daemon = 1;
+            break;
+        case 'f':
+            app.mwm_funcs = strtoul(optarg, NULL, 0);
+            break;
+        case 'D':
+            app.mwm_decor = strtoul(optarg, NULL, 0);
+            break;
+        case 'h':
+            exit_usage(0);
+            break;
+        default:
+            break;
+        }
+    }
+
+    if (app.tile_count == 0) {
+        pm_error("No tiles specified");
+        exit_usage(1);
+    }
+}
+
+static void
+daemonize(void)
+{
+    signal(SIGUSR1, handle_sigusr1);
+    signal(SIGCHLD, handle_sigchld);
+
+    pid_t pid = fork();
+    pm_assert(pid >= 0, "Failed to fork");
+
+    if (pid > 0) {
+        // Parent process
+
+        while (1) {
+            pause();
+        }
+    }
+
+    // Child process
+
+    signal(SIGUSR1, SIG_DFL);
+    signal(SIGCHLD, SIG_DFL);
+
+    app.parent_pid = getppid();
+
+    pm_assert(setsid() >= 0, "Failed to create new session");
+
+    close(STDIN_FILENO);
+
+    int fd = open("/dev/null", O_RDWR);
+    pm_assert(fd >= 0, "Failed to open /dev/null");
+
+    dup2(fd, STDIN_FILENO);
+
+    if (fd > STDERR_FILENO) {
+        close(fd);
+    }
+
+    pm_debug("Daemonized child process %d", getpid());
+}
+
+static void
+setup_display(void)
+{
+    app.display = XOpenDisplay(NULL);
+    pm_assert(app.display != NULL, "Cannot open display");
+
+    XSetErrorHandler(handle_error_event);
+    XSetIOErrorHandler(handle_io_error_event);
+
+    app.screen = DefaultScreen(app.display);
+    app.watches[WATCH_DISPLAY].fd = ConnectionNumber(app.display);
+    app.root_window = RootWindow(app.display, app.screen);
+
+    // Intern all atoms in a single round trip
+    XInternAtoms(app.display, (char **)ATOM_NAMES, ATOM_COUNT, False, app.atoms);
+
+    update_root_events();
+
+#ifdef USE_RANDR
+    int randr_error_base;
+
+    if (XRRQueryExtension(app.display, &app.randr_event_base, &randr_error_base)) {
+        XRRSelectInput(app.display, app.root_window, RRScreenChangeNotifyMask);
+    } else {
+        pm_debug("XRandR extension not available");
+        app.randr_event_base = -1;
+    }
+#else
+    if (app.output_name != NULL) {
+        pm_warn("Built without XRandR, placing relative to the screen");
     }
+#endif
 
-    XGetErrorText(display, error->error_code, error_text, sizeof(error_text));
+#ifdef USE_DAMAGE
+    int damage_error_base;
 
-    pm_debug("X11 Error (%d, %d, 0x%lx): %s",
-        error->request_code, error->minor_code, error->resourceid, error_text);
+    if (app.hud && !XDamageQueryExtension(app.display, &app.damage_event_base, &damage_error_base)) {
+        pm_debug("XDamage extension not available");
+        app.damage_event_base = -1;
+    }
+#endif
 
-    return 0;
+    setup_images();
 }
 
-static int
-handle_io_error_event(Display *display)
+static void
+update_root_events(void)
 {
-    (void)display;
+    long mask = 0;
 
-    pm_debug("X11 IO Error");
+    // Root window creation events are only needed until all dockapps are swallowed
+    if (!check_all_dockapps_swallowed()) {
+        mask |= SubstructureNotifyMask;
+    }
 
-    terminate_dockapps();
+    // Client list changes are only needed for tasks or while a launch is pending
+    if (app.fullscreen_yield || app.task_tile >= 0 || (app.override_redirect && app.above_all)
+        || check_launch_pending()) {
+        mask |= PropertyChangeMask;
+    }
 
-    exit(1);
+    app.platform->select_root_events(mask);
 }
 
 static void
-handle_create_event(const XEvent *event)
+create_dock_window(void)
 {
-    Window window = event->xcreatewindow.window;
-    XClassHint class_hint;
+    struct size size = get_dock_size();
+    struct position pos = get_dock_position();
+    unsigned width = size.width;
+    unsigned height = size.height;
+    int x = pos.x;
+    int y = pos.y;
+
+    app.dock_pos = pos;
+    app.dock_window = XCreateSimpleWindow(app.display, app.root_window,
+        x, y, width, height, 0,
+        BlackPixel(app.display, app.screen), WhitePixel(app.display, app.screen));
+
+    XStoreName(app.display, app.dock_window, "PMDock");
+
+    set_mwm_hints(app.dock_window, 0x03, app.mwm_funcs, app.mwm_decor);
+    set_wm_class_hint(app.dock_window, "pmdock", "PMDock");
+
+    if (app.above_all) {
+        set_wm_above_hint(app.dock_window);
+    }
+
+    if (app.all_desktops) {
+        set_wm_desktop_hint(app.dock_window, -1);
+    }
+
+    if (app.override_redirect) {
+        XSetWindowAttributes attrs = { .override_redirect = True };
+        XChangeWindowAttributes(app.display, app.dock_window, CWOverrideRedirect, &attrs);
+    }
+
+    XMapWindow(app.display, app.dock_window);
+    XMoveResizeWindow(app.display, app.dock_window, x, y, width, height);
+
+    XSelectInput(app.display, app.dock_window, ExposureMask | StructureNotifyMask | VisibilityChangeMask);
+
+    app.gc = XCreateGC(app.display, app.dock_window, 0, NULL);
+
+    app.bg_pixmap = XCreatePixmap(app.display, app.dock_window, app.tile_size, app.tile_size,
+        DefaultDepth(app.display, app.screen));
+
+    compose_background();
+    create_glyph_cache();
+
+    if (app.hud) {
+        // Paint over swallowed dockapps as well
+        XGCValues values = { .subwindow_mode = IncludeInferiors };
+
+        app.hud_gc = XCreateGC(app.display, app.dock_window, GCSubwindowMode, &values);
+        app.hud_refreshed_at = get_time_ms();
+        set_timer(TIMER_HUD, HUD_INTERVAL_MS);
+    }
+
+    pm_debug("Created dock window 0x%lx at %ux%u+%d+%d", app.dock_window, width, height, x, y);
+}
+
+static void
+compose_background(void)
+{
+    image_t bg = load_image(&app.bg_image, app.bg_path);
+
+    XSetForeground(app.display, app.gc, BlackPixel(app.display, app.screen));
+    XFillRectangle(app.display, app.bg_pixmap, app.gc, 0, 0, app.tile_size, app.tile_size);
+
+    if (bg != NULL) {
+        struct size bg_size = image_get_size(bg);
+        image_render(bg, app.bg_pixmap, 0, 0, bg_size.width, bg_size.height);
+    }
+}
+
+static Pixmap
+acquire_pixmap(uint64_t hash, int *created)
+{
+    struct shared_pixmap *shared;
+
+    for (shared = app.pixmaps; shared; shared = shared->next) {
+        if (shared->hash == hash) {
+            shared->refs++;
+            *created = 0;
+            return shared->pixmap;
+        }
+    }
+
+    shared = calloc(1, sizeof(struct shared_pixmap));
+    pm_assert(shared != NULL, "Failed to allocate memory");
+
+    shared->hash = hash;
+    shared->pixmap = XCreatePixmap(app.display, app.dock_window, app.tile_size, app.tile_size,
+        DefaultDepth(app.display, app.screen));
+    shared->refs = 1;
+    shared->next = app.pixmaps;
+    app.pixmaps = shared;
+
+    *created = 1;
+    return shared->pixmap;
+}
+
+static void
+release_pixmap(Pixmap pixmap)
+{
+    for (struct shared_pixmap **p = &app.pixmaps; *p; p = &(*p)->next) {
+        struct shared_pixmap *shared = *p;
+
+        if (shared->pixmap != pixmap) {
+            continue;
+        }
+
+        if (--shared->refs == 0) {
+            XFreePixmap(app.display, shared->pixmap);
+            *p = shared->next;
+            free(shared);
+        }
 
-    if (!XGetClassHint(app.display, window, &class_hint)) {
         return;
     }
+}
 
-    pm_debug("Created window 0x%lx with res_name '%s'", window, class_hint.res_name);
+static void
+compose_launcher(unsigned index)
+{
+    int created;
 
-    for (unsigned i = 0; i < app.tile_count; ++i) {
-        if (app.tiles[i].window == 0 && app.tiles[i].res_name && !strcmp(class_hint.res_name, app.tiles[i].res_name)) {
-            swallow_dockapp(window, i);
-            break;
+    // Launchers with identical icon files share one pixmap, the icon
+    // is only decoded and uploaded for the first of them
+    app.tiles[index].pixmap = acquire_pixmap(hash_file(app.tiles[index].icon_path), &created);
+
+    if (!created) {
+        return;
+    }
+
+    image_t icon = load_image(&app.tiles[index].icon, app.tiles[index].icon_path);
+
+    XCopyArea(app.display, app.bg_pixmap, app.tiles[index].pixmap, app.gc,
+        0, 0, app.tile_size, app.tile_size, 0, 0);
+    count_tile_bytes(index, app.tile_size, app.tile_size);
+
+    if (icon != NULL) {
+        render_image_centered(icon, app.tiles[index].pixmap);
+        count_tile_bytes(index, app.tile_size, app.tile_size);
+    }
+}
+
+#ifdef USE_SVG
+static int
+reload_image(image_t *image, const char *path)
+{
+    if (*image != NULL) {
+        return 1;
+    }
+
+    if (check_svg_path(path)) {
+        char cache_path[PATH_MAX];
+
+        // Without a usable cache, load_image rasterizes it again
+        get_svg_cache_path(path, app.tile_size, cache_path, sizeof(cache_path));
+
+        if (access(cache_path, R_OK) == 0 || access(path, R_OK) == 0) {
+            return 1;
         }
+    } else if ((*image = image_load(path)) != NULL) {
+        return 1;
     }
 
-    XFree(class_hint.res_name);
-    XFree(class_hint.res_class);
+    pm_warn("Failed to reload image %s, keeping its tile", path);
+
+    return 0;
 }
 
 static void
-handle_button_press_event(const XEvent *event)
+refresh_launchers(const image_t *icon)
 {
+    Pixmap pixmap = None;
+    unsigned owner = 0;
+
     for (unsigned i = 0; i < app.tile_count; i++) {
-        if (app.tiles[i].type == TILE_TYPE_LAUNCHER && event->xbutton.window == app.tiles[i].window) {
-            unsigned pid = fork();
+        if (&app.tiles[i].icon == icon) {
+            pixmap = app.tiles[i].pixmap;
+            owner = i;
+        }
+    }
 
-            if (pid == 0) {
-                execl("/bin/sh", "/bin/sh", "-c", app.tiles[i].command, (char *)NULL);
-                pm_assert(0, "Failed to execute %s", app.tiles[i].command);
-            }
+    if (pixmap == None) {
+        return;
+    }
 
-            break;
+    // Other launchers may share the pixmap, the one holding the image composes it again
+    for (unsigned i = 0; i < app.tile_count; i++) {
+        if (app.tiles[i].type == TILE_TYPE_LAUNCHER && app.tiles[i].pixmap == pixmap) {
+            release_pixmap(pixmap);
+            app.tiles[i].pixmap = None;
+            app.tiles[i].dirty |= DIRTY_TILE;
+        }
+    }
+
+    compose_launcher(owner);
+
+    for (unsigned i = 0; i < app.tile_count; i++) {
+        if (app.tiles[i].type == TILE_TYPE_LAUNCHER && app.tiles[i].pixmap == None) {
+            compose_launcher(i);
         }
     }
 }
 
 static void
-handle_expose_event(Window window)
+refresh_tiles(void)
 {
+    // Images dropped under memory pressure are loaded again, unlike
+    // at startup a file deleted since then is not fatal
+    if (reload_image(&app.bg_image, app.bg_path)) {
+        compose_background();
+    }
+
+    // Release all pixmaps first, so each shared one is composed only once
     for (unsigned i = 0; i < app.tile_count; i++) {
-        struct position pos = get_tile_position(i);
+        struct tile *tile = &app.tiles[i];
 
-        if (window == app.dock_window && app.tiles[i].type != TILE_TYPE_LAUNCHER) {
-            imlib_context_set_drawable(app.dock_window);
-            imlib_context_set_image(app.bg_image);
-            imlib_render_image_on_drawable(pos.x, pos.y);
+        if (tile->type == TILE_TYPE_LAUNCHER && reload_image(&tile->icon, tile->icon_path)) {
+            release_pixmap(tile->pixmap);
+            tile->pixmap = None;
+        }
+    }
 
-            continue;
+    for (unsigned i = 0; i < app.tile_count; i++) {
+        if (app.tiles[i].type == TILE_TYPE_LAUNCHER && app.tiles[i].pixmap == None) {
+            compose_launcher(i);
         }
 
-        if (window == app.tiles[i].window && app.tiles[i].type == TILE_TYPE_LAUNCHER) {
-            imlib_context_set_image(app.bg_image);
-            imlib_context_set_drawable(app.tiles[i].window);
-            imlib_render_image_on_drawable(0, 0);
+        app.tiles[i].dirty |= DIRTY_TILE;
+    }
 
-            imlib_context_set_image(app.tiles[i].icon);
-            unsigned width = imlib_image_get_width();
-            unsigned height = imlib_image_get_height();
-            int x = width < app.tile_size ? (app.tile_size - width) / 2 : 0;
-            int y = height < app.tile_size ? (app.tile_size - height) / 2 : 0;
-            imlib_render_image_on_drawable(x, y);
+    // Tasks are only composed once the background is ready, there's no need
+    // to read their icons again
+    for (unsigned i = 0; i < app.task_count; i++) {
+        if (app.tasks[i].pixmap == None) {
+            compose_task(i);
+            app.tasks[i].dirty = 1;
+        }
+    }
+}
+#endif
 
+static void
+create_launchers(void)
+{
+    for (unsigned i = 0; i < app.tile_count; i++) {
+        if (app.tiles[i].type != TILE_TYPE_LAUNCHER) {
             continue;
         }
+
+        struct position pos = get_tile_position(i);
+
+        Window win = XCreateSimpleWindow(app.display, app.dock_window,
+            pos.x, pos.y, app.tile_size, app.tile_size, 0,
+            BlackPixel(app.display, app.screen),
+            WhitePixel(app.display, app.screen));
+
+        app.tiles[i].window = win;
+
+        // Compose the tile once, exposes are then served from the server
+        compose_launcher(i);
+
+        XSelectInput(app.display, win, ExposureMask | ButtonPressMask);
+        XMapWindow(app.display, win);
+
+        pm_debug("Created launcher window 0x%lx at %ux%u", win, pos.x, pos.y);
+    }
+}
+
+static int
+find_task(Window client)
+{
+    for (unsigned i = 0; i < app.task_count; i++) {
+        if (app.tasks[i].client == client) {
+            return i;
+        }
     }
+
+    return -1;
+}
+
+static int
+check_skip_taskbar(Window client)
+{
+    return check_window_state(client, app.atoms[ATOM_NET_WM_STATE_SKIP_TASKBAR]);
 }
 
 static void
-parse_opts(int argc, char *argv[])
+compose_task(unsigned index)
 {
-    int opt;
-    const char *pending_command = NULL;
-    const char *pending_icon = NULL;
-    const char *pending_resname = NULL;
-    const char *bg_path = DEFAULT_BG_PATH;
-    unsigned current_tile = 0;
-    const char *optstring = "aAb:c:D:df:Hhi:s:t:r:vx:y:";
+    struct task *task = &app.tasks[index];
+    unsigned long nitems = 0;
+    unsigned long *best = NULL;
+    uint64_t hash = FNV_OFFSET;
+    Pixmap old = task->pixmap;
+    int created;
+
+#ifdef USE_SVG
+    // Icons are composed over the background, wait until it's rasterized
+    if (check_svg_pending(&app.bg_image)) {
+        return;
+    }
+#endif
 
-    // First pass: count tiles
-    optind = 1;
-    while ((opt = getopt(argc, argv, optstring)) != -1) {
-        if (opt == 't') {
-            ++app.tile_count;
+    // 32-bit items are returned as longs
+    unsigned long *data = (unsigned long *)get_window_property(task->client, app.atoms[ATOM_NET_WM_ICON],
+        XA_CARDINAL, TASK_ICON_MAX_ITEMS, &nitems);
+
+    // Pick the smallest icon not smaller than the tile, or else the largest one
+    for (unsigned long i = 0; i + 2 < nitems;) {
+        unsigned long width = data[i];
+        unsigned long height = data[i + 1];
+
+        // Sizes come from the client, don't let their product overflow
+        if (width == 0 || height == 0 || height > (nitems - i - 2) / width) {
+            break;
+        }
+
+        if (best == NULL || (best[0] < app.tile_size && width > best[0])
+            || (width >= app.tile_size && width < best[0])) {
+            best = &data[i];
         }
+
+        i += 2 + width * height;
     }
 
-    if (app.tile_count > 0) {
-        app.tiles = calloc(app.tile_count, sizeof(struct tile));
-        pm_assert(app.tiles != NULL, "Failed to allocate memory");
+    // Windows of the same application usually share the icon, and a pixmap
+    for (unsigned long i = 0; best != NULL && i < 2 + best[0] * best[1]; i++) {
+        uint32_t item = best[i];
+        hash = hash_bytes(hash, &item, sizeof(item));
     }
 
-    // Second pass: process arguments
-    optind = 1;
-    while ((opt = getopt(argc, argv, optstring)) != -1) {
-        switch (opt) {
-        case 'A':
-            app.above_all = 1;
-            break;
-        case 'a':
-            app.all_desktops = 1;
-            break;
-        case 'v':
-            app.verbose = 1;
-            break;
-        case 'x':
-            app.initial_x = atoi(optarg);
-            break;
-        case 'y':
-            app.initial_y = atoi(optarg);
-            break;
-        case 's': {
-            int size = atoi(optarg);
-            if (size <= 0) {
-                pm_error("Invalid tile size: %s", optarg);
-                exit_usage(1);
-            }
-            app.tile_size = size;
-            break;
+    task->pixmap = acquire_pixmap(hash, &created);
+
+    if (old != None) {
+        release_pixmap(old);
+    }
+
+    if (created) {
+        XCopyArea(app.display, app.bg_pixmap, task->pixmap, app.gc, 0, 0, app.tile_size, app.tile_size, 0, 0);
+    }
+
+    if (best != NULL && created) {
+        unsigned long count = best[0] * best[1];
+        uint32_t *pixels = malloc(count * sizeof(uint32_t));
+        pm_assert(pixels != NULL, "Failed to allocate memory");
+
+        for (unsigned long i = 0; i < count; i++) {
+            pixels[i] = best[2 + i];
         }
-        case 'H':
-            app.horizontal = 1;
-            break;
-        case 'r':
-            pending_resname = optarg;
-            break;
-        case 'i':
-            pending_icon = optarg;
-            break;
-        case 'c':
-            pending_command = optarg;
-            break;
-        case 't':
-            if (!pending_command) {
-                pm_error("Error: -t requires preceding -c to specify command");
-                exit_usage(1);
-            }
 
-            if (strcmp(optarg, "dockapp") == 0) {
-                if (!pending_resname) {
-                    pm_error("Error: dockapp type requires preceding -r to specify resource name");
-                    exit_usage(1);
-                }
+        // Scale down once, the property isn't read again until it changes
+        image_t image = image_from_pixels(best[0], best[1], pixels);
+
+        if (image != NULL) {
+            render_image_centered(image, task->pixmap);
+            image_free(image);
+        }
+
+        free(pixels);
+    }
+
+    if (data) {
+        XFree(data);
+    }
+}
+
+static void
+create_task(unsigned index)
+{
+    struct task *task = &app.tasks[index];
+    struct position pos = get_slot_position(task->slot);
+
+    task->window = XCreateSimpleWindow(app.display, app.dock_window,
+        pos.x, pos.y, app.tile_size, app.tile_size, 0,
+        BlackPixel(app.display, app.screen),
+        WhitePixel(app.display, app.screen));
+
+    task->pixmap = None;
+    compose_task(index);
+
+    XSelectInput(app.display, task->client, PropertyChangeMask);
+    XSelectInput(app.display, task->window, ExposureMask | ButtonPressMask);
+    XMapWindow(app.display, task->window);
+
+    pm_debug("Created task window 0x%lx for client 0x%lx", task->window, task->client);
+}
 
-                app.tiles[current_tile].type = TILE_TYPE_APP;
-                app.tiles[current_tile].command = pending_command;
-                app.tiles[current_tile].res_name = pending_resname;
-            } else if (strcmp(optarg, "launcher") == 0) {
-                if (!pending_icon) {
-                    pm_error("Error: launcher type requires preceding -i to specify icon");
-                    exit_usage(1);
-                }
+static void
+destroy_task(struct task *task)
+{
+    // Skipped clients stay watched, in case they stop skipping the taskbar
+    if (task->client != app.active_window && !task->skipped) {
+        XSelectInput(app.display, task->client, 0);
+    }
 
-                app.tiles[current_tile].type = TILE_TYPE_LAUNCHER;
-                app.tiles[current_tile].command = pending_command;
-                app.tiles[current_tile].icon = imlib_load_image(pending_icon);
-                pm_assert(app.tiles[current_tile].icon != NULL, "Failed to load icon %s", pending_icon);
-            } else {
-                pm_error("Error: invalid type '%s' (must be 'dockapp' or 'launcher')", optarg);
-                exit_usage(1);
+    XDestroyWindow(app.display, task->window);
+    release_pixmap(task->pixmap);
+
+    pm_debug("Destroyed task window 0x%lx for client 0x%lx", task->window, task->client);
+}
+
+static void
+shift_tiles(int slots)
+{
+    int dx = app.horizontal ? slots * (int)app.tile_size : 0;
+    int dy = app.horizontal ? 0 : slots * (int)app.tile_size;
+
+    // Only tiles after the tasks group move
+    for (unsigned i = app.task_tile + 1; i < app.tile_count; i++) {
+        struct tile *tile = &app.tiles[i];
+
+        if (tile->type == TILE_TYPE_LAUNCHER) {
+            struct position pos = get_tile_position(i);
+            XMoveWindow(app.display, tile->window, pos.x, pos.y);
+        } else if (tile->type == TILE_TYPE_APP) {
+            // Also keeps positions of dockapps still being swallowed up to date
+            tile->swallow_icon_pos.x += dx;
+            tile->swallow_icon_pos.y += dy;
+            tile->swallow_main_pos.x += dx;
+            tile->swallow_main_pos.y += dy;
+
+            if (tile->window != 0) {
+                XMoveWindow(app.display, tile->swallow_icon, tile->swallow_icon_pos.x, tile->swallow_icon_pos.y);
+                XMoveWindow(app.display, tile->swallow_main, tile->swallow_main_pos.x, tile->swallow_main_pos.y);
             }
+        }
+    }
+}
 
-            current_tile++;
+static void
+update_tasks(const Window *clients, unsigned long count)
+{
+    struct task *tasks = calloc(count + 1, sizeof(struct task));
+    unsigned old_count = app.task_count;
+    unsigned task_count = 0;
 
-            pending_command = NULL;
-            pending_icon = NULL;
-            pending_resname = NULL;
+    pm_assert(tasks != NULL, "Failed to allocate memory");
 
-            break;
-        case 'b':
-            bg_path = optarg;
-            break;
-        case 'd':
-            app.daemon_mode = 1;
-            break;
-        case 'f':
-            app.mwm_funcs = strtoul(optarg, NULL, 0);
-            break;
-        case 'D':
-            app.mwm_decor = strtoul(optarg, NULL, 0);
-            break;
-        case 'h':
-            exit_usage(0);
-            break;
-        default:
-            break;
+    // Keep known clients as they are, only new ones are inspected
+    for (unsigned long i = 0; i < count; i++) {
+        int known = find_task(clients[i]);
+
+        if (known >= 0 && !app.tasks[known].skipped) {
+            tasks[task_count++] = app.tasks[known];
+            app.tasks[known].client = None;
+        } else if (check_own_window(clients[i])) {
+            continue;
+        } else if (!check_skip_taskbar(clients[i])) {
+            tasks[task_count++] = (struct task) { .client = clients[i], .window = None };
+        } else if (known < 0) {
+            // Get notified if it stops skipping the taskbar
+            XSelectInput(app.display, clients[i], PropertyChangeMask);
         }
     }
 
-    if (app.tile_count == 0) {
-        pm_error("No tiles specified");
-        exit_usage(1);
+    for (unsigned i = 0; i < old_count; i++) {
+        if (app.tasks[i].client != None) {
+            destroy_task(&app.tasks[i]);
+        }
+    }
+
+    free(app.tasks);
+    app.tasks = tasks;
+    app.task_count = task_count;
+
+    // Create new task windows and move only the ones whose slot changed
+    for (unsigned i = 0; i < task_count; i++) {
+        unsigned slot = app.task_tile + i;
+
+        if (tasks[i].window == None) {
+            tasks[i].slot = slot;
+            create_task(i);
+        } else if (tasks[i].slot != slot) {
+            struct position pos = get_slot_position(slot);
+
+            tasks[i].slot = slot;
+            XMoveWindow(app.display, tasks[i].window, pos.x, pos.y);
+        }
     }
 
-    app.bg_image = imlib_load_image(bg_path);
-    pm_assert(app.bg_image != NULL, "Failed to load background image: %s", bg_path);
+    if (task_count != old_count) {
+        shift_tiles((int)task_count - (int)old_count);
+        move_dock_window();
+
+        for (unsigned i = app.task_tile + 1; i < app.tile_count; i++) {
+            app.tiles[i].dirty |= DIRTY_TILE;
+        }
+
+        pm_debug("Showing %u tasks", task_count);
+    }
 }
 
 static void
-daemonize(void)
+activate_task(unsigned index)
 {
-    pid_t pid = fork();
-    pm_assert(pid >= 0, "Failed to fork");
+    XEvent event = { 0 };
 
-    if (pid > 0) {
-        // Parent process
+    event.xclient.type = ClientMessage;
+    event.xclient.window = app.tasks[index].client;
+    event.xclient.message_type = app.atoms[ATOM_NET_ACTIVE_WINDOW];
+    event.xclient.format = 32;
+    event.xclient.data.l[0] = 2; // Request from a pager
+    event.xclient.data.l[1] = CurrentTime;
 
-        signal(SIGUSR1, handle_sigusr1);
-        pause();
+    XSendEvent(app.display, app.root_window, False, SubstructureRedirectMask | SubstructureNotifyMask, &event);
+}
+
+static void
+create_control_socket(void)
+{
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
 
-        pm_assert(0, "Parent process should not reach this point");
+    if (app.control_path == NULL) {
+        return;
     }
 
-    // Child process
+    pm_assert(strlen(app.control_path) < sizeof(addr.sun_path), "Control socket path too long");
+    strcpy(addr.sun_path, app.control_path);
 
-    pm_assert(setsid() >= 0, "Failed to create new session");
+    int fd = socket(AF_UNIX, SOCK_DGRAM, 0);
+    pm_assert(fd >= 0, "Failed to create control socket");
 
-    close(STDIN_FILENO);
+    unlink(app.control_path);
 
-    int fd = open("/dev/null", O_RDWR);
-    pm_assert(fd >= 0, "Failed to open /dev/null");
+    // Only the owner may send commands, which include starting launchers
+    mode_t old_umask = umask(0077);
+    int ret = bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+    umask(old_umask);
 
-    dup2(fd, STDIN_FILENO);
+    pm_assert(ret == 0, "Failed to bind control socket %s: %s", app.control_path, strerror(errno));
 
-    if (fd > STDERR_FILENO) {
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+    app.watches[WATCH_CONTROL].fd = fd;
+
+    // Also on failed assertions, children leave it alone by using _exit
+    atexit(remove_control_socket);
+
+    pm_debug("Listening for commands on %s", app.control_path);
+}
+
+static void
+create_pressure_trigger(void)
+{
+    int fd = open("/proc/pressure/memory", O_RDWR | O_NONBLOCK | O_CLOEXEC);
+
+    if (fd < 0) {
+        pm_debug("Memory pressure information not available");
+        return;
+    }
+
+    if (write(fd, PRESSURE_TRIGGER, strlen(PRESSURE_TRIGGER) + 1) < 0) {
+        pm_debug("Failed to register memory pressure trigger: %s", strerror(errno));
         close(fd);
+        return;
     }
 
-    pm_debug("Daemonized child process %d", getpid());
+    app.watches[WATCH_PRESSURE].fd = fd;
+
+    pm_debug("Registered memory pressure trigger");
 }
 
 static void
-setup_display(void)
+create_power_monitor(void)
 {
-    app.display = XOpenDisplay(NULL);
-    pm_assert(app.display != NULL, "Cannot open display");
+    if (!app.power_profiles) {
+        return;
+    }
 
-    XSetErrorHandler(handle_error_event);
-    XSetIOErrorHandler(handle_io_error_event);
+#ifdef __linux__
+    struct sockaddr_nl addr = { .nl_family = AF_NETLINK, .nl_groups = 1 };
+    int fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC, NETLINK_KOBJECT_UEVENT);
 
-    app.screen = DefaultScreen(app.display);
-    app.root_window = RootWindow(app.display, app.screen);
+    if (fd < 0 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        pm_warn("Failed to monitor power supply events: %s", strerror(errno));
+
+        if (fd >= 0) {
+            close(fd);
+        }
 
-    XSelectInput(app.display, app.root_window, SubstructureNotifyMask);
+        return;
+    }
 
-    imlib_context_set_display(app.display);
-    imlib_context_set_visual(DefaultVisual(app.display, DefaultScreen(app.display)));
-    imlib_context_set_colormap(DefaultColormap(app.display, DefaultScreen(app.display)));
+    app.watches[WATCH_POWER].fd = fd;
+
+    apply_profile(&PROFILES[check_on_battery() ? PROFILE_BATTERY : PROFILE_AC]);
+#else
+    pm_warn("Power profiles are not supported on this platform");
+#endif
 }
 
 static void
-create_dock_window(void)
+create_idle_monitor(void)
 {
-    unsigned width = app.horizontal ? app.tile_count * app.tile_size : app.tile_size;
-    unsigned height = app.horizontal ? app.tile_size : app.tile_count * app.tile_size;
-    int x = app.initial_x;
-    int y = app.initial_y;
+    int error_base, dpms_event_base;
 
-    app.dock_window = XCreateSimpleWindow(app.display, app.root_window,
-        x, y, width, height, 0,
-        BlackPixel(app.display, app.screen), WhitePixel(app.display, app.screen));
+    if (!app.idle_freeze) {
+        return;
+    }
 
-    XStoreName(app.display, app.dock_window, "PMDock");
+#ifdef USE_SCRNSAVER
+    if (XScreenSaverQueryExtension(app.display, &app.saver_event_base, &error_base)) {
+        XScreenSaverSelectInput(app.display, app.root_window, ScreenSaverNotifyMask);
+    } else {
+        pm_warn("MIT-SCREEN-SAVER extension not available");
+        app.saver_event_base = -1;
+    }
+#endif
 
-    set_mwm_hints(app.dock_window, 0x03, app.mwm_funcs, app.mwm_decor);
-    set_wm_class_hint(app.dock_window, "pmdock", "PMDock");
+    // Without screen saver events, DPMS is polled all the time
+    if (DPMSQueryExtension(app.display, &dpms_event_base, &error_base) && DPMSCapable(app.display)) {
+        app.dpms_capable = 1;
 
-    if (app.above_all) {
-        set_wm_above_hint(app.dock_window);
+        if (app.saver_event_base < 0) {
+            set_timer(TIMER_DPMS, app.dpms_check_ms);
+        }
     }
+}
 
-    if (app.all_desktops) {
-        set_wm_desktop_hint(app.dock_window, -1);
+static void
+remove_control_socket(void)
+{
+    if (app.watches[WATCH_CONTROL].fd >= 0) {
+        unlink(app.control_path);
     }
+}
 
-    XMapWindow(app.display, app.dock_window);
-    XMoveResizeWindow(app.display, app.dock_window, x, y, width, height);
+static double
+read_pressure(const char *path)
+{
+    FILE *f = fopen(path, "r");
+    double ret = -1;
 
-    XSelectInput(app.display, app.dock_window, ExposureMask | StructureNotifyMask);
+    if (f == NULL) {
+        return -1;
+    }
 
-    pm_debug("Created dock window 0x%lx at %ux%u+%d+%d", app.dock_window, width, height, x, y);
+    if (fscanf(f, "some avg10=%lf", &ret) != 1) {
+        ret = -1;
+    }
+
+    fclose(f);
+
+    return ret;
 }
 
-static void
-create_launchers(void)
+static int
+check_system_busy(void)
 {
-    for (unsigned i = 0; i < app.tile_count; i++) {
-        if (app.tiles[i].type != TILE_TYPE_LAUNCHER) {
-            continue;
+    double load;
+
+    if (app.max_load > 0 && getloadavg(&load, 1) == 1 && load > app.max_load) {
+        pm_debug("Load average %.2f exceeds %.2f", load, app.max_load);
+        return 1;
+    }
+
+    if (app.max_cpu_pressure > 0) {
+        double pressure = read_pressure("/proc/pressure/cpu");
+
+        if (pressure > app.max_cpu_pressure) {
+            pm_debug("CPU pressure %.2f exceeds %.2f", pressure, app.max_cpu_pressure);
+            return 1;
         }
+    }
 
-        struct position pos = get_tile_position(i);
+    return 0;
+}
 
-        Window win = XCreateSimpleWindow(app.display, app.dock_window,
-            pos.x, pos.y, app.tile_size, app.tile_size, 0,
-            BlackPixel(app.display, app.screen),
-            WhitePixel(app.display, app.screen));
+static void
+start_dockapp(unsigned index)
+{
+    struct tile *tile = &app.tiles[index];
 
-        app.tiles[i].window = win;
+    tile->pid = app.platform->spawn_process(tile->command);
+    pm_assert(tile->pid >= 0, "Failed to fork");
 
-        XSelectInput(app.display, win, ExposureMask | ButtonPressMask);
-        XMapWindow(app.display, win);
+    app.child_count++;
 
-        pm_debug("Created launcher window 0x%lx at %ux%u", win, pos.x, pos.y);
-    }
+    tile->started_at = get_time_ms();
+    app.last_launch_at = tile->started_at;
+
+    pm_debug("Started dockapp %s in tile %u with pid %d", tile->command, index, tile->pid);
 }
 
 static void
-start_dockapps(void)
+start_pending_dockapps(void)
 {
-    for (unsigned i = 0; i < app.tile_count; i++) {
-        if (app.tiles[i].type != TILE_TYPE_APP) {
-            continue;
+    cancel_timer(TIMER_STARTUP);
+
+    while (1) {
+        long long now = get_time_ms();
+        long long next_timeout = 0;
+        unsigned starting = 0;
+        int next = -1;
+
+        for (unsigned i = 0; i < app.tile_count; i++) {
+            struct tile *tile = &app.tiles[i];
+
+            if (tile->type != TILE_TYPE_APP || tile->window != 0) {
+                continue;
+            }
+
+            if (tile->started_at == 0) {
+                if (next < 0 || tile->priority > app.tiles[next].priority) {
+                    next = i;
+                }
+            } else if (now - tile->started_at < STARTUP_TIMEOUT_MS) {
+                long long timeout = tile->started_at + STARTUP_TIMEOUT_MS;
+
+                if (next_timeout == 0 || timeout < next_timeout) {
+                    next_timeout = timeout;
+                }
+
+                starting++;
+            }
         }
 
-        app.tiles[i].pid = fork();
-        pm_assert(app.tiles[i].pid >= 0, "Failed to fork");
+        if (next < 0) {
+            return;
+        }
+
+        // Wait until a starting dockapp is swallowed or times out
+        if (app.max_jobs > 0 && starting >= app.max_jobs) {
+            set_timer(TIMER_STARTUP, next_timeout - now);
+            return;
+        }
 
-        if (app.tiles[i].pid == 0) {
-            execl("/bin/sh", "/bin/sh", "-c", app.tiles[i].command, (char *)NULL);
-            exit(1);
+        // Don't let a permanently busy system starve the dock
+        if (now - app.last_launch_at < STARTUP_MAX_WAIT_MS && check_system_busy()) {
+            set_timer(TIMER_STARTUP, app.profile->sample_interval_ms);
+            return;
         }
 
-        pm_debug("Started dockapp %s with pid %d", app.tiles[i].command, app.tiles[i].pid);
+        start_dockapp(next);
+    }
+}
+
+static void
+start_dockapps(void)
+{
+    app.last_launch_at = get_time_ms();
+
+    start_pending_dockapps();
+
+    if (!check_all_dockapps_swallowed() && app.profile->animations) {
+        set_timer(TIMER_PLACEHOLDER, PLACEHOLDER_INTERVAL_MS);
     }
 }
 
@@ -806,9 +5030,101 @@ terminate_dockapps(void)
 {
     pm_debug("Terminating dockapps");
 
+    // Dockapps run in their own process groups, signal all of their processes
     for (unsigned i = 0; i < app.tile_count; i++) {
         if (app.tiles[i].pid > 0) {
-            kill(app.tiles[i].pid, SIGTERM);
+            app.platform->signal_process(-app.tiles[i].pid, SIGTERM);
+
+            if (app.freeze_reasons) {
+                app.platform->signal_process(-app.tiles[i].pid, SIGCONT);
+            }
+        }
+    }
+}
+
+static void
+handle_event(XEvent *event)
+{
+#ifdef USE_RANDR
+    if (app.randr_event_base >= 0 && event->type == app.randr_event_base + RRScreenChangeNotify) {
+        handle_screen_change_event(event);
+        return;
+    }
+#endif
+
+#ifdef USE_SCRNSAVER
+    if (app.saver_event_base >= 0 && event->type == app.saver_event_base + ScreenSaverNotify) {
+        handle_screen_saver_event(event);
+        return;
+    }
+#endif
+
+#ifdef USE_DAMAGE
+    if (app.damage_event_base >= 0 && event->type == app.damage_event_base + XDamageNotify) {
+        handle_damage_event(event);
+        return;
+    }
+#endif
+
+    switch (event->type) {
+    case CreateNotify:
+        handle_create_event(event);
+        break;
+    case Expose:
+        handle_expose_event(&event->xexpose);
+        break;
+    case ButtonPress:
+        handle_button_press_event(event);
+        break;
+    case PropertyNotify:
+        handle_property_event(event);
+        break;
+    case VisibilityNotify:
+        set_dock_hidden(event->xvisibility.state == VisibilityFullyObscured);
+        break;
+    case UnmapNotify:
+        if (event->xunmap.window == app.dock_window) {
+            set_dock_hidden(1);
+        }
+        break;
+    }
+}
+
+static void
+run_event_loop(void)
+{
+    XEvent event;
+
+    while (1) {
+        if (app.child_exited) {
+            reap_children();
+        }
+
+        run_timers();
+
+        // XPending flushes the output buffer before checking for events
+        while (XPending(app.display)) {
+            XNextEvent(app.display, &event);
+            handle_event(&event);
+        }
+
+        // Repaint each tile changed by timers or events at most once, and
+        // not at all while the dock can't be seen, they stay marked until then
+        if (!app.freeze_reasons) {
+            paint_dirty_tiles();
+        }
+
+        XFlush(app.display);
+
+        if (poll(app.watches, WATCH_COUNT, get_poll_timeout()) < 0) {
+            pm_assert(errno == EINTR, "Failed to poll: %s", strerror(errno));
+            continue;
+        }
+
+        for (unsigned i = 0; i < WATCH_COUNT; i++) {
+            if (app.watches[i].revents && WATCH_HANDLERS[i] != NULL) {
+                WATCH_HANDLERS[i](app.watches[i].fd);
+            }
         }
     }
 }
@@ -816,41 +5132,67 @@ terminate_dockapps(void)
 int
 main(int argc, char *argv[])
 {
-    XEvent event;
+    app.started_at = get_time_ms();
 
     parse_opts(argc, argv);
 
+    // Before the first fork, so every child can be given the original nice level
+    if (app.nice_level != 0) {
+        read_inherited_nice();
+    }
+
     if (app.daemon_mode) {
         daemonize();
         // Now we're in the child process
     }
 
+    // Dockapps run in their own process groups, which the terminal doesn't signal
     signal(SIGTERM, handle_sigterm);
+    signal(SIGINT, handle_sigterm);
+    signal(SIGHUP, handle_sigterm);
+
+    create_child_pipe();
+    signal(SIGCHLD, handle_child_signal);
 
     setup_display();
     create_dock_window();
     create_launchers();
 
+    if (app.task_tile >= 0) {
+        update_client_list(0);
+    }
+
+    create_control_socket();
+    create_pressure_trigger();
+    create_power_monitor();
+    create_idle_monitor();
+
+    if (app.fullscreen_yield) {
+        update_active_window();
+    }
+
     XFlush(app.display);
 
     start_dockapps();
 
-    while (1) {
-        XNextEvent(app.display, &event);
+    if (app.early_daemon || check_all_dockapps_swallowed()) {
+        // The dock is usable now, dockapps show placeholders until swallowed
+        XSync(app.display, False);
+        notify_parent();
+    }
 
-        switch (event.type) {
-        case CreateNotify:
-            handle_create_event(&event);
-            break;
-        case Expose:
-            handle_expose_event(event.xexpose.window);
-            break;
-        case ButtonPress:
-            handle_button_press_event(&event);
-            break;
-        }
+    pm_debug("Dock ready %lld ms after startup", get_time_ms() - app.started_at);
+
+    if (app.nice_level != 0) {
+        raise_priority();
+    }
+
+    if (app.lock_memory) {
+        lock_dock_memory();
     }
 
+    run_event_loop();
+
     // NOTREACHED
     return 1;
 }
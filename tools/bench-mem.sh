@@ -0,0 +1,245 @@
+#!/bin/sh
+#
+# Drives pmdock on Xvfb through a fixed number of workload iterations and
+# samples its memory, file descriptors, X server resources and unreaped
+# children, failing if any of them grows.
+#
+# Environment:
+#   PMDOCK        pmdock binary (default: ./pmdock)
+#   DOCKAPP       dockapp command (default: wmclockmon)
+#   RESNAME       its res_name (default: same as DOCKAPP)
+#   COUNT         number of dockapp tiles kept running (default: 3)
+#   KILLS         number of extra dockapp tiles killed during the run (default: 2)
+#   ITERATIONS    number of workload iterations (default: 400)
+#   SAMPLE_EVERY  iterations between samples (default: 20)
+#   PAUSE         seconds between iterations (default: 0.02)
+#   RSS_SLACK     allowed RSS/PSS growth in KiB (default: 256)
+#   XRES_SLACK    allowed growth of each X resource count (default: 0)
+#   SAMPLES       file to keep the samples in (default: temporary)
+#
+# Instead of waiting in real time, each iteration does what would take
+# minutes of normal use. It picks one running dockapp by its pid, in turn,
+# and exposes its tile and the launcher (with xrefresh), clicks both (with
+# xdotool), so the launcher starts a child to reap, and updates the badge
+# through the control socket (with socat). pmdock doesn't restart dockapps,
+# so the KILLS extra tiles are killed one by one by pid, spread over the
+# run, and each must be reaped. Parts whose tool isn't installed are
+# skipped.
+#
+# X resources of the dock's client are counted by type with xrestop, which
+# finds the client by pid through the XRes extension, and skipped if it's
+# not installed. The first quarter of the run is a warm-up, the last sample
+# is compared against the end of it.
+
+set -eu
+
+PMDOCK=${PMDOCK:-./pmdock}
+DOCKAPP=${DOCKAPP:-wmclockmon}
+RESNAME=${RESNAME:-$DOCKAPP}
+COUNT=${COUNT:-3}
+KILLS=${KILLS:-2}
+ITERATIONS=${ITERATIONS:-400}
+SAMPLE_EVERY=${SAMPLE_EVERY:-20}
+PAUSE=${PAUSE:-0.02}
+RSS_SLACK=${RSS_SLACK:-256}
+XRES_SLACK=${XRES_SLACK:-0}
+
+DISPLAY_NUM=93
+TILE=64
+TIMEOUT=60
+
+TMP=$(mktemp -d)
+SAMPLES=${SAMPLES:-$TMP/samples}
+SOCKET=$TMP/pmdock.sock
+XVFB_PID=
+DOCK_PID=
+
+cleanup() {
+    for pid in $DOCK_PID $XVFB_PID; do
+        kill "$pid" 2>/dev/null || true
+    done
+    rm -rf "$TMP"
+}
+
+trap cleanup EXIT INT TERM
+
+export DISPLAY=:$DISPLAY_NUM
+
+wait_for() {
+    i=0
+    while ! eval "$1"; do
+        i=$((i + 1))
+        if [ $i -gt $((TIMEOUT * 10)) ]; then
+            echo "bench-mem: timed out waiting for: $1" >&2
+            exit 1
+        fi
+        sleep 0.1
+    done
+}
+
+has() {
+    command -v "$1" >/dev/null
+}
+
+# Prints a field from /proc/PID/smaps_rollup in KiB
+get_smaps() {
+    awk -v key="$1:" '$1 == key { print $2 }' "/proc/$DOCK_PID/smaps_rollup"
+}
+
+# Prints the dock client's windows, GCs, pixmaps, pictures and other
+# resources, or dashes without xrestop
+get_xres() {
+    if has xrestop; then
+        # Clients are listed as "N - NAME ( PID: PID ):", followed by "type : count" lines
+        xrestop -b -m 1 2>/dev/null | awk -v pid="$DOCK_PID" '
+            / - / && /\( PID:/ { dock = ($0 ~ ("PID: *" pid " *\\)")) }
+            dock && /:/ {
+                split($0, kv, ":")
+                key = kv[1]
+                gsub(/^[ \t]+|[ \t]+$/, "", key)
+                n[key] = kv[2] + 0
+                found = 1
+            }
+            END {
+                if (!found) { print "- - - - -"; exit }
+                print n["windows"], n["GCs"], n["pixmaps"], n["pictures"],
+                    n["fonts"] + n["glyphsets"] + n["colormaps"] + n["cursors"] + n["passive grabs"] + n["unknowns"]
+            }
+        '
+    else
+        echo "- - - - -"
+    fi
+}
+
+get_zombies() {
+    ps -o stat= --ppid "$DOCK_PID" 2>/dev/null | grep -c '^Z' || true
+}
+
+# Prints the position of a tile's top left corner on the screen
+get_tile_position() {
+    echo "$DOCK_X $((DOCK_Y + $1 * TILE))"
+}
+
+poke_tile() {
+    set -- $(get_tile_position "$1")
+
+    if has xrefresh; then
+        xrefresh -geometry "${TILE}x${TILE}+$1+$2"
+    fi
+
+    if has xdotool; then
+        xdotool mousemove $(($1 + TILE / 2)) $(($2 + TILE / 2)) click 1
+    fi
+}
+
+sample() {
+    printf '%6s %8s %8s %5s %5s %5s %5s %5s %5s %7s\n' "$1" "$(get_smaps Rss)" "$(get_smaps Pss)" \
+        "$(ls "/proc/$DOCK_PID/fd" | wc -l)" $(get_xres) "$(get_zombies)" | tee -a "$SAMPLES"
+}
+
+Xvfb :$DISPLAY_NUM -ac -nolisten tcp -screen 0 1024x768x24 >"$TMP/xvfb.log" 2>&1 &
+XVFB_PID=$!
+wait_for "[ -S /tmp/.X11-unix/X$DISPLAY_NUM ]"
+
+set -- -s $TILE -S "$SOCKET" -c true -i tile-default.png -t launcher
+i=0
+while [ $i -lt $((COUNT + KILLS)) ]; do
+    set -- "$@" -c "$DOCKAPP" -r "$RESNAME" -t dockapp
+    i=$((i + 1))
+done
+
+$PMDOCK -v "$@" >"$TMP/dock.log" 2>&1 &
+DOCK_PID=$!
+wait_for "grep -q 'All dockapps swallowed' '$TMP/dock.log' || ! kill -0 $DOCK_PID 2>/dev/null"
+
+if ! kill -0 "$DOCK_PID" 2>/dev/null; then
+    echo "bench-mem: pmdock exited, log:" >&2
+    cat "$TMP/dock.log" >&2
+    exit 1
+fi
+
+set -- $(sed -n 's/.*Created dock window 0x[0-9a-f]* at [0-9]*x[0-9]*+\(-*[0-9]*\)+\(-*[0-9]*\)$/\1 \2/p' "$TMP/dock.log")
+DOCK_X=$1
+DOCK_Y=$2
+
+# Dockapps as "PID:TILE", the last KILLS of them are killed during the run
+DOCKAPPS=$(sed -n 's/.*Started dockapp .* in tile \([0-9]*\) with pid \([0-9]*\)$/\2:\1/p' "$TMP/dock.log" | sort -t: -k2 -n)
+RUNNING=$(echo "$DOCKAPPS" | head -n "$COUNT")
+VICTIMS=$(echo "$DOCKAPPS" | tail -n +$((COUNT + 1)))
+KILL_EVERY=$((ITERATIONS / (KILLS + 1) > 0 ? ITERATIONS / (KILLS + 1) : 1))
+
+printf '%6s %8s %8s %5s %5s %5s %5s %5s %5s %7s\n' iter rss_kib pss_kib fds win gc pix pict other zombies | tee "$SAMPLES"
+
+iter=0
+zombie_samples=0
+
+while [ $iter -le "$ITERATIONS" ]; do
+    if ! kill -0 "$DOCK_PID" 2>/dev/null; then
+        echo "bench-mem: pmdock exited during the run" >&2
+        exit 1
+    fi
+
+    # Victims are killed evenly spread over the run
+    if [ -n "$VICTIMS" ] && [ $iter -gt 0 ] && [ $((iter % KILL_EVERY)) -eq 0 ]; then
+        victim=$(echo "$VICTIMS" | head -n 1)
+        VICTIMS=$(echo "$VICTIMS" | tail -n +2)
+
+        kill "${victim%%:*}"
+        wait_for "[ ! -e /proc/${victim%%:*} ]"
+        poke_tile "${victim#*:}"
+    fi
+
+    target=$(echo "$RUNNING" | sed -n "$((iter % COUNT + 1))p")
+
+    if ! kill -0 "${target%%:*}" 2>/dev/null; then
+        echo "bench-mem: dockapp ${target%%:*} exited during the run" >&2
+        exit 1
+    fi
+
+    poke_tile "${target#*:}"
+    poke_tile 0
+
+    if has socat; then
+        echo "badge 0 $((iter % 1000))" | socat - "UNIX-SENDTO:$SOCKET" 2>/dev/null || true
+    fi
+
+    if [ $((iter % SAMPLE_EVERY)) -eq 0 ]; then
+        sample $iter
+
+        # Children are reaped from the event loop, which may take a moment
+        if [ "$(tail -n 1 "$SAMPLES" | awk '{ print $NF }')" -gt 0 ]; then
+            zombie_samples=$((zombie_samples + 1))
+        else
+            zombie_samples=0
+        fi
+
+        if [ $zombie_samples -ge 2 ]; then
+            echo "bench-mem: pmdock leaves unreaped children" >&2
+            exit 1
+        fi
+    fi
+
+    sleep "$PAUSE"
+    iter=$((iter + 1))
+done
+
+# Compare the last sample with the one at the end of the warm-up
+awk -v warmup=$((ITERATIONS / 4)) -v rss_slack="$RSS_SLACK" -v xres_slack="$XRES_SLACK" '
+    NR == 1 { for (i = 5; i <= 9; i++) names[i] = $i; next }
+    !base && $1 >= warmup { base = 1; for (i = 2; i <= 9; i++) start[i] = $i }
+    { for (i = 2; i <= 9; i++) last[i] = $i }
+    END {
+        status = 0
+        if (last[2] - start[2] > rss_slack) { print "bench-mem: RSS grew by " last[2] - start[2] " KiB"; status = 1 }
+        if (last[3] - start[3] > rss_slack) { print "bench-mem: PSS grew by " last[3] - start[3] " KiB"; status = 1 }
+        if (last[4] > start[4]) { print "bench-mem: open files grew from " start[4] " to " last[4]; status = 1 }
+        for (i = 5; i <= 9; i++) {
+            if (start[i] != "-" && last[i] - start[i] > xres_slack) {
+                print "bench-mem: X " names[i] " resources grew from " start[i] " to " last[i]
+                status = 1
+            }
+        }
+        if (!status) { print "bench-mem: no growth" }
+        exit status
+    }
+' "$SAMPLES" >&2
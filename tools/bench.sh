@@ -0,0 +1,125 @@
+#!/bin/sh
+#
+# Measures pmdock startup and swallow time as a function of the X round
+# trip time, by running it on Xvfb through the xlatency proxy.
+#
+# Environment:
+#   PMDOCK      pmdock binary (default: ./pmdock)
+#   XLATENCY    proxy binary (default: tools/xlatency)
+#   DOCKAPP     dockapp command (default: wmclockmon)
+#   RESNAME     its res_name (default: same as DOCKAPP)
+#   COUNT       number of dockapp tiles (default: 3)
+#   RTTS        round trip times in ms (default: "0 5 10 25 50 100")
+#   BANDWIDTH   bandwidth limit in KiB/s (default: unlimited)
+#   MAX_TRIPS   fail if swallowing costs more round trips than this
+#
+# For each RTT it prints the time until the dock is mapped, the time until
+# all dockapps are swallowed, and the number of round trips the latter
+# grew by compared to the first RTT, which is what regressions show up in.
+
+set -eu
+
+PMDOCK=${PMDOCK:-./pmdock}
+XLATENCY=${XLATENCY:-tools/xlatency}
+DOCKAPP=${DOCKAPP:-wmclockmon}
+RESNAME=${RESNAME:-$DOCKAPP}
+COUNT=${COUNT:-3}
+RTTS=${RTTS:-0 5 10 25 50 100}
+BANDWIDTH=${BANDWIDTH:-}
+MAX_TRIPS=${MAX_TRIPS:-}
+
+SERVER=91
+PROXY=92
+TIMEOUT=60
+
+TMP=$(mktemp -d)
+XVFB_PID=
+PROXY_PID=
+DOCK_PID=
+
+cleanup() {
+    for pid in $DOCK_PID $PROXY_PID $XVFB_PID; do
+        kill "$pid" 2>/dev/null || true
+    done
+    rm -rf "$TMP"
+}
+
+trap cleanup EXIT INT TERM
+
+wait_for() {
+    i=0
+    while ! eval "$1"; do
+        i=$((i + 1))
+        if [ $i -gt $((TIMEOUT * 10)) ]; then
+            echo "bench: timed out waiting for: $1" >&2
+            exit 1
+        fi
+        sleep 0.1
+    done
+}
+
+# Prints the number of milliseconds from a pmdock debug line
+get_ms() {
+    sed -n "s/.*$1 \([0-9]*\) ms after startup.*/\1/p" "$TMP/dock.log" | head -n 1
+}
+
+Xvfb :$SERVER -ac -nolisten tcp -screen 0 1024x768x24 >"$TMP/xvfb.log" 2>&1 &
+XVFB_PID=$!
+wait_for "[ -S /tmp/.X11-unix/X$SERVER ]"
+
+set --
+i=0
+while [ $i -lt "$COUNT" ]; do
+    set -- "$@" -c "$DOCKAPP" -r "$RESNAME" -t dockapp
+    i=$((i + 1))
+done
+
+printf '%8s %10s %14s %8s\n' rtt_ms ready_ms swallowed_ms trips
+
+base=
+status=0
+
+for rtt in $RTTS; do
+    $XLATENCY -r "$rtt" ${BANDWIDTH:+-b "$BANDWIDTH"} :$PROXY :$SERVER &
+    PROXY_PID=$!
+    wait_for "[ -S /tmp/.X11-unix/X$PROXY ]"
+
+    DISPLAY=:$PROXY $PMDOCK -v "$@" >"$TMP/dock.log" 2>&1 &
+    DOCK_PID=$!
+    wait_for "grep -q 'All dockapps swallowed' '$TMP/dock.log' || ! kill -0 $DOCK_PID 2>/dev/null"
+
+    ready=$(get_ms "Dock ready")
+    swallowed=$(get_ms "All dockapps swallowed")
+
+    kill "$DOCK_PID" "$PROXY_PID" 2>/dev/null || true
+    wait "$DOCK_PID" "$PROXY_PID" 2>/dev/null || true
+    DOCK_PID=
+    PROXY_PID=
+
+    if [ -z "$swallowed" ]; then
+        echo "bench: dockapps not swallowed at ${rtt} ms RTT, log:" >&2
+        cat "$TMP/dock.log" >&2
+        exit 1
+    fi
+
+    if [ -z "$base" ]; then
+        base_rtt=$rtt
+        base=$swallowed
+    fi
+
+    trips=-
+    if [ "$rtt" -gt "$base_rtt" ]; then
+        trips=$(((swallowed - base) / (rtt - base_rtt)))
+        if [ -n "$MAX_TRIPS" ] && [ "$trips" -gt "$MAX_TRIPS" ]; then
+            status=1
+        fi
+    fi
+
+    printf '%8s %10s %14s %8s\n' "$rtt" "${ready:--}" "$swallowed" "$trips"
+done
+
+if [ $status -ne 0 ]; then
+    echo "bench: swallowing takes more than $MAX_TRIPS round trips" >&2
+fi
+
+exit $status
@@ -0,0 +1,750 @@
+/*
+ * swallowsim - Deterministic simulation of pmdock's dockapp lifecycle
+ *
+ * Copyright (C) 2024-2025 luke8086 <luke8086@fastmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>
+ */
+
+// Runs the real startup, swallow and reaping code from pmdock.c through
+// its platform interface, against a simulated X server, window manager and
+// dockapps driven by a virtual clock. Every scenario is generated from a
+// seed, with random startup delays, late or missing icon window hints,
+// window managers slow to manage and unmanage windows, and crashes. After
+// each scenario settles, invariants are checked on the resulting state.
+
+#include <stdint.h>
+
+#define main pmdock_main
+#include "../pmdock.c"
+#undef main
+
+#define SIM_MAX_TILES 8
+#define SIM_MAX_EVENTS 256
+#define SIM_MAX_STEPS 100000
+#define SIM_MAX_REPORTS 20
+
+// Virtual time a scenario may take to settle, starting from a non-zero
+// clock since pmdock uses 0 for unset timestamps
+#define SIM_START_US 1000000LL
+#define SIM_LIMIT_MS 120000
+
+// Dockapps setting their icon hint at most this late must get swallowed
+#define SIM_HINT_GRACE_MS 100
+
+#define SIM_ROOT 1
+#define SIM_DOCK 2
+#define SIM_FRAME 3 // any frame of the window manager
+#define SIM_FIRST_WINDOW 0x100
+#define SIM_FIRST_PID 1000
+
+#define EVENT_CREATE 0 // dockapp creates its windows and maps the main one
+#define EVENT_ICON_HINT 1 // dockapp sets the icon window hint
+#define EVENT_CRASH 2 // dockapp exits, its windows are destroyed
+#define EVENT_WM_MANAGE 3 // WM reparents a mapped window into a frame
+#define EVENT_WM_UNMANAGE 4 // WM gives an unmapped window back to the root
+
+struct sim_event {
+    long long at_us;
+    unsigned proc;
+    unsigned long seq;
+    unsigned type;
+    Window window;
+};
+
+struct sim_window {
+    int alive;
+    int mapped;
+    int override;
+    Window parent;
+    struct position pos;
+    struct size size;
+};
+
+// A dockapp process, spawned for the tile with the same index, although
+// dockapps with the same res_name may end up in each other's tiles
+struct sim_process {
+    long long crash_ms; // after spawning, 0 for never
+    int crashed;
+    long long create_ms; // after spawning
+    int created;
+    long long hint_ms; // after creating windows, -1 for never
+    int hint_set;
+    pid_t pid;
+    int reaped;
+};
+
+static struct {
+    char commands[SIM_MAX_TILES][16];
+    unsigned event_count;
+    struct sim_event events[SIM_MAX_EVENTS];
+    struct app initial;
+    unsigned long next_seq;
+    long long now_us;
+    struct sim_process procs[SIM_MAX_TILES];
+    unsigned reports;
+    char res_names[SIM_MAX_TILES][24];
+    uint64_t rng;
+    long root_mask;
+    uint64_t seed;
+    long long settle_ms[1 << 16];
+    unsigned settle_count;
+    unsigned scenario_violations;
+    unsigned violations;
+    int verbose;
+    struct sim_window windows[SIM_MAX_TILES * 2];
+    int wm;
+    long long wm_latency_ms;
+} sim;
+
+// Without animations, so the placeholder timer never needs a display
+static const struct profile PROFILE_SIM = {
+    .name = "simulation",
+    .animations = 0,
+    .badge_interval_ms = 100,
+    .freeze_hidden = 0,
+    .sample_interval_ms = 500,
+    .timer_slack_ns = 0,
+};
+
+static uint64_t sim_random(uint64_t);
+static void sim_report(const char *, ...);
+static struct sim_window *sim_get_window(Window);
+static struct sim_process *sim_find_process(pid_t);
+static void sim_schedule(long long, unsigned, unsigned, Window);
+static long long sim_next_event(void);
+static void sim_deliver(const struct sim_event *);
+static int sim_bypass_window_manager(Window);
+static int sim_check_window_manager(void);
+static Window sim_get_icon_window(Window);
+static long long sim_get_time_us(void);
+static struct size sim_get_window_size(Window);
+static void sim_map_window(Window);
+static void sim_reparent_window(Window, struct position);
+static void sim_select_root_events(long);
+static void sim_set_border_width(Window, unsigned);
+static int sim_signal_process(pid_t, int);
+static pid_t sim_spawn_process(const char *);
+static void sim_unmap_window(Window);
+static pid_t sim_wait_child(int *);
+static void sim_setup(uint64_t);
+static void sim_check(void);
+static void sim_run(uint64_t);
+static int compare_ms(const void *, const void *);
+
+static const struct platform PLATFORM_SIM = {
+    .bypass_window_manager = sim_bypass_window_manager,
+    .check_window_manager = sim_check_window_manager,
+    .get_icon_window = sim_get_icon_window,
+    .get_time_us = sim_get_time_us,
+    .get_window_size = sim_get_window_size,
+    .map_window = sim_map_window,
+    .reparent_window = sim_reparent_window,
+    .select_root_events = sim_select_root_events,
+    .set_border_width = sim_set_border_width,
+    .signal_process = sim_signal_process,
+    .spawn_process = sim_spawn_process,
+    .unmap_window = sim_unmap_window,
+    .wait_child = sim_wait_child,
+};
+
+static uint64_t
+sim_random(uint64_t range)
+{
+    // xorshift64*, so scenarios only depend on the seed
+    sim.rng ^= sim.rng >> 12;
+    sim.rng ^= sim.rng << 25;
+    sim.rng ^= sim.rng >> 27;
+
+    return range ? (sim.rng * 0x2545f4914f6cdd1dULL) % range : 0;
+}
+
+static void
+sim_report(const char *fmt, ...)
+{
+    sim.scenario_violations++;
+
+    if (sim.reports++ >= SIM_MAX_REPORTS) {
+        return;
+    }
+
+    va_list args;
+    va_start(args, fmt);
+    printf("seed %llu at %lld ms: ", (unsigned long long)sim.seed, sim.now_us / 1000);
+    vprintf(fmt, args);
+    printf("\n");
+    va_end(args);
+}
+
+static struct sim_window *
+sim_get_window(Window window)
+{
+    if (window < SIM_FIRST_WINDOW || window >= SIM_FIRST_WINDOW + SIM_MAX_TILES * 2) {
+        sim_report("request on unknown window 0x%lx", window);
+        return NULL;
+    }
+
+    struct sim_window *win = &sim.windows[window - SIM_FIRST_WINDOW];
+
+    // Requests on destroyed windows fail with BadWindow, which is ignored
+    return win->alive ? win : NULL;
+}
+
+static struct sim_process *
+sim_find_process(pid_t pid)
+{
+    for (unsigned i = 0; i < app.tile_count; i++) {
+        if (sim.procs[i].pid == pid) {
+            return &sim.procs[i];
+        }
+    }
+
+    return NULL;
+}
+
+static void
+sim_schedule(long long delay_ms, unsigned type, unsigned proc, Window window)
+{
+    if (sim.event_count == SIM_MAX_EVENTS) {
+        sim_report("event queue overflow");
+        return;
+    }
+
+    sim.events[sim.event_count++] = (struct sim_event) {
+        .at_us = sim.now_us + delay_ms * 1000,
+        .proc = proc,
+        .seq = sim.next_seq++,
+        .type = type,
+        .window = window,
+    };
+}
+
+static long long
+sim_next_event(void)
+{
+    long long next = -1;
+
+    for (unsigned i = 0; i < sim.event_count; i++) {
+        if (next < 0 || sim.events[i].at_us < next) {
+            next = sim.events[i].at_us;
+        }
+    }
+
+    return next;
+}
+
+static int
+sim_bypass_window_manager(Window window)
+{
+    struct sim_window *win = sim_get_window(window);
+
+    if (win == NULL) {
+        return 0;
+    }
+
+    win->override = 1;
+
+    return win->parent != SIM_FRAME;
+}
+
+static int
+sim_check_window_manager(void)
+{
+    return sim.wm;
+}
+
+static Window
+sim_get_icon_window(Window window)
+{
+    if (sim_get_window(window) == NULL) {
+        return None;
+    }
+
+    unsigned proc = (unsigned)(window - SIM_FIRST_WINDOW) / 2;
+
+    return sim.procs[proc].hint_set ? window + 1 : None;
+}
+
+static long long
+sim_get_time_us(void)
+{
+    return sim.now_us;
+}
+
+static struct size
+sim_get_window_size(Window window)
+{
+    struct sim_window *win = sim_get_window(window);
+
+    return win ? win->size : (struct size) { 0, 0 };
+}
+
+static void
+sim_map_window(Window window)
+{
+    struct sim_window *win = sim_get_window(window);
+
+    if (win) {
+        win->mapped = 1;
+    }
+}
+
+static void
+sim_reparent_window(Window window, struct position pos)
+{
+    struct sim_window *win = sim_get_window(window);
+
+    if (win) {
+        win->parent = SIM_DOCK;
+        win->pos = pos;
+    }
+}
+
+static void
+sim_select_root_events(long mask)
+{
+    sim.root_mask = mask;
+}
+
+static void
+sim_set_border_width(Window window, unsigned width)
+{
+    (void)width; // Unused parameter
+    sim_get_window(window);
+}
+
+static int
+sim_signal_process(pid_t pid, int signo)
+{
+    (void)signo; // Unused parameter
+
+    // Dockapps are signalled as process groups, the parent by its pid
+    struct sim_process *proc = sim_find_process(pid < 0 ? -pid : pid);
+
+    if (proc && proc->reaped) {
+        sim_report("signalled pid %d after reaping it", proc->pid);
+    }
+
+    return 0;
+}
+
+static pid_t
+sim_spawn_process(const char *command)
+{
+    unsigned index = (unsigned)atoi(command);
+    struct sim_process *proc = &sim.procs[index];
+
+    if (proc->pid) {
+        sim_report("dockapp %u started twice", index);
+    }
+
+    proc->pid = SIM_FIRST_PID + (pid_t)index;
+    sim_schedule(proc->create_ms, EVENT_CREATE, index, None);
+
+    if (proc->crash_ms) {
+        sim_schedule(proc->crash_ms, EVENT_CRASH, index, None);
+    }
+
+    return proc->pid;
+}
+
+static void
+sim_unmap_window(Window window)
+{
+    struct sim_window *win = sim_get_window(window);
+
+    if (win == NULL) {
+        return;
+    }
+
+    win->mapped = 0;
+
+    if (win->parent == SIM_FRAME) {
+        sim_schedule(sim.wm_latency_ms, EVENT_WM_UNMANAGE, 0, window);
+    }
+}
+
+static pid_t
+sim_wait_child(int *status)
+{
+    for (unsigned i = 0; i < app.tile_count; i++) {
+        struct sim_process *proc = &sim.procs[i];
+
+        if (proc->crashed && !proc->reaped) {
+            proc->reaped = 1;
+            *status = 1 << 8; // exit status 1
+            return proc->pid;
+        }
+    }
+
+    return 0;
+}
+
+static void
+sim_deliver(const struct sim_event *event)
+{
+    struct sim_process *proc = &sim.procs[event->proc];
+    Window main_window = SIM_FIRST_WINDOW + event->proc * 2;
+    struct sim_window *win;
+
+    switch (event->type) {
+    case EVENT_CREATE:
+        if (proc->crashed) {
+            return;
+        }
+
+        proc->created = 1;
+
+        for (unsigned i = 0; i < 2; i++) {
+            sim.windows[event->proc * 2 + i].alive = 1;
+            sim.windows[event->proc * 2 + i].parent = SIM_ROOT;
+        }
+
+        if (proc->hint_ms == 0) {
+            proc->hint_set = 1;
+        } else if (proc->hint_ms > 0) {
+            sim_schedule(proc->hint_ms, EVENT_ICON_HINT, event->proc, None);
+        }
+
+        // Without a WM the map request is granted at once
+        if (sim.wm) {
+            sim_schedule(sim.wm_latency_ms, EVENT_WM_MANAGE, event->proc, main_window);
+        } else {
+            sim.windows[event->proc * 2].mapped = 1;
+        }
+
+        if (sim.root_mask & SubstructureNotifyMask) {
+            int index = find_dockapp_tile(sim.res_names[event->proc]);
+
+            if (index >= 0) {
+                swallow_dockapp(main_window, index);
+            }
+        }
+
+        return;
+    case EVENT_ICON_HINT:
+        proc->hint_set = !proc->crashed;
+        return;
+    case EVENT_CRASH:
+        proc->crashed = 1;
+        sim.windows[event->proc * 2].alive = 0;
+        sim.windows[event->proc * 2 + 1].alive = 0;
+        app.child_exited = 1;
+        return;
+    case EVENT_WM_MANAGE:
+        win = &sim.windows[event->window - SIM_FIRST_WINDOW];
+
+        // A WM slower than the dock takes windows back from it
+        if (win->alive && !win->override) {
+            win->parent = SIM_FRAME;
+            win->mapped = 1;
+        }
+
+        return;
+    case EVENT_WM_UNMANAGE:
+        win = &sim.windows[event->window - SIM_FIRST_WINDOW];
+
+        if (win->alive) {
+            win->parent = SIM_ROOT;
+        }
+
+        return;
+    default:
+        return;
+    }
+}
+
+static void
+sim_setup(uint64_t seed)
+{
+    free(app.tiles);
+    app = sim.initial;
+
+    memset(sim.procs, 0, sizeof(sim.procs));
+    memset(sim.windows, 0, sizeof(sim.windows));
+    sim.event_count = 0;
+    sim.next_seq = 0;
+    sim.root_mask = 0;
+    sim.scenario_violations = 0;
+    sim.seed = seed;
+    sim.rng = seed * 0x9e3779b97f4a7c15ULL + 1;
+    sim.now_us = SIM_START_US;
+    sim.wm = sim_random(2);
+    sim.wm_latency_ms = (long long)sim_random(81);
+
+    app.platform = &PLATFORM_SIM;
+    app.profile = &PROFILE_SIM;
+    app.verbose = sim.verbose;
+    app.dock_window = SIM_DOCK;
+    app.root_window = SIM_ROOT;
+    app.override_redirect = sim_random(4) == 0;
+    app.horizontal = (int)sim_random(2);
+    app.max_jobs = (unsigned)sim_random(4);
+    app.tile_count = 1 + (unsigned)sim_random(SIM_MAX_TILES);
+    app.tiles = calloc(app.tile_count, sizeof(struct tile));
+    pm_assert(app.tiles != NULL, "Failed to allocate memory");
+
+    for (unsigned i = 0; i < app.tile_count; i++) {
+        struct sim_process *proc = &sim.procs[i];
+        struct tile *tile = &app.tiles[i];
+
+        // Some dockapps are started twice with the same res_name
+        if (i > 0 && sim_random(10) == 0) {
+            memcpy(sim.res_names[i], sim.res_names[i - 1], sizeof(sim.res_names[i]));
+        } else {
+            snprintf(sim.res_names[i], sizeof(sim.res_names[i]), "dockapp%u", i);
+        }
+
+        // The command only tells which process to simulate
+        snprintf(sim.commands[i], sizeof(sim.commands[i]), "%u", i);
+
+        tile->command = sim.commands[i];
+        tile->priority = (int)sim_random(3);
+        tile->res_name = sim.res_names[i];
+        tile->type = TILE_TYPE_APP;
+
+        proc->create_ms = sim_random(10) ? (long long)sim_random(500) : (long long)sim_random(8000);
+        proc->crash_ms = sim_random(10) ? 0 : 1 + (long long)sim_random(6000);
+
+        uint64_t hint = sim_random(20);
+        proc->hint_ms = hint < 14 ? 0 : hint < 18 ? (long long)sim_random(SIM_HINT_GRACE_MS + 1) : -1;
+
+        for (unsigned j = 0; j < 2; j++) {
+            sim.windows[i * 2 + j].size.width = 16 + (unsigned)sim_random(49);
+            sim.windows[i * 2 + j].size.height = 16 + (unsigned)sim_random(49);
+        }
+    }
+
+    app.started_at = get_time_ms();
+}
+
+static void
+sim_check(void)
+{
+    unsigned expected = 0;
+    unsigned swallowed = 0;
+    unsigned unreaped = 0;
+
+    for (unsigned i = 0; i < app.tile_count; i++) {
+        struct sim_process *proc = &sim.procs[i];
+
+        if (proc->pid == 0) {
+            sim_report("dockapp %u was never started", i);
+        }
+
+        if (proc->pid && !proc->reaped) {
+            unreaped++;
+        }
+
+        if (!proc->crashed && proc->hint_ms >= 0) {
+            expected++;
+        }
+
+        if (proc->crashed && !proc->reaped) {
+            sim_report("dockapp %u was never reaped", i);
+        }
+    }
+
+    if (app.child_count != unreaped) {
+        sim_report("child count is %u, expected %u", app.child_count, unreaped);
+    }
+
+    for (unsigned i = 0; i < app.tile_count; i++) {
+        const struct tile *tile = &app.tiles[i];
+        struct position tile_pos = get_tile_position(i);
+
+        if (tile->swallow_stage != SWALLOW_IDLE) {
+            sim_report("tile %u is still swallowing", i);
+        }
+
+        if (tile->pid && sim_find_process(tile->pid) && sim_find_process(tile->pid)->reaped) {
+            sim_report("tile %u keeps pid %d after reaping it", i, tile->pid);
+        }
+
+        if (tile->window == 0) {
+            continue;
+        }
+
+        for (unsigned j = 0; j < i; j++) {
+            if (app.tiles[j].window == tile->window) {
+                sim_report("window 0x%lx swallowed by tiles %u and %u", tile->window, j, i);
+            }
+        }
+
+        if (tile->window < SIM_FIRST_WINDOW || (tile->window - SIM_FIRST_WINDOW) % 2 != 1) {
+            sim_report("tile %u swallowed 0x%lx, which is not an icon window", i, tile->window);
+            continue;
+        }
+
+        struct sim_window *icon = &sim.windows[tile->window - SIM_FIRST_WINDOW];
+        struct sim_window *main_window = icon - 1;
+
+        // Dockapps which crashed after being swallowed leave a dead window
+        if (!icon->alive) {
+            continue;
+        }
+
+        swallowed++;
+
+        if (icon->parent != SIM_DOCK || main_window->parent != SIM_DOCK) {
+            sim_report("windows of tile %u ended up outside the dock", i);
+        }
+
+        if (!icon->mapped) {
+            sim_report("icon window of tile %u is not mapped", i);
+        }
+
+        if (icon->pos.x < tile_pos.x || icon->pos.y < tile_pos.y
+            || icon->pos.x + (int)icon->size.width > tile_pos.x + (int)app.tile_size
+            || icon->pos.y + (int)icon->size.height > tile_pos.y + (int)app.tile_size) {
+            sim_report("icon window of tile %u is outside the tile", i);
+        }
+    }
+
+    if (swallowed != expected) {
+        sim_report("%u dockapps swallowed, expected %u", swallowed, expected);
+    }
+
+    // Creation events are only needed while some dockapp may still appear
+    if (!check_all_dockapps_swallowed() != !!(sim.root_mask & SubstructureNotifyMask)) {
+        sim_report("root window events don't match the swallow state");
+    }
+}
+
+static void
+sim_run(uint64_t seed)
+{
+    sim_setup(seed);
+
+    update_root_events();
+    start_dockapps();
+
+    // The same steps as run_event_loop, with events and timers in virtual time
+    for (unsigned steps = 0;; steps++) {
+        if (app.child_exited) {
+            reap_children();
+        }
+
+        run_timers();
+
+        long long next = sim_next_event();
+
+        for (unsigned i = 0; i < TIMER_COUNT; i++) {
+            if (app.timers[i] && !check_timer_paused(i) && (next < 0 || app.timers[i] * 1000 < next)) {
+                next = app.timers[i] * 1000;
+            }
+        }
+
+        if (next < 0) {
+            break;
+        }
+
+        if (steps == SIM_MAX_STEPS || next / 1000 - app.started_at > SIM_LIMIT_MS) {
+            sim_report("did not settle");
+            break;
+        }
+
+        if (next > sim.now_us) {
+            sim.now_us = next;
+        }
+
+        // Deliver due events in the order they were scheduled in
+        while (1) {
+            int due = -1;
+
+            for (unsigned i = 0; i < sim.event_count; i++) {
+                if (sim.events[i].at_us <= sim.now_us && (due < 0 || sim.events[i].seq < sim.events[due].seq)) {
+                    due = (int)i;
+                }
+            }
+
+            if (due < 0) {
+                break;
+            }
+
+            struct sim_event event = sim.events[due];
+            sim.events[due] = sim.events[--sim.event_count];
+            sim_deliver(&event);
+        }
+    }
+
+    sim_check();
+
+    if (sim.settle_count < sizeof(sim.settle_ms) / sizeof(sim.settle_ms[0])) {
+        sim.settle_ms[sim.settle_count++] = get_time_ms() - app.started_at;
+    }
+
+    sim.violations += sim.scenario_violations;
+}
+
+static int
+compare_ms(const void *a, const void *b)
+{
+    long long x = *(const long long *)a;
+    long long y = *(const long long *)b;
+
+    return (x > y) - (x < y);
+}
+
+int
+main(int argc, char *argv[])
+{
+    unsigned long count = 10000;
+    uint64_t first_seed = 1;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:s:v")) != -1) {
+        switch (opt) {
+        case 'n':
+            count = strtoul(optarg, NULL, 10);
+            break;
+        case 's':
+            first_seed = strtoull(optarg, NULL, 10);
+            break;
+        case 'v':
+            sim.verbose = 1;
+            break;
+        default:
+            fprintf(stderr, "swallowsim [-n COUNT] [-s SEED] [-v]\n");
+            return 1;
+        }
+    }
+
+    // Warnings from thousands of scenarios are only noise, unless replaying one
+    if (!sim.verbose && freopen("/dev/null", "w", stderr) == NULL) {
+        return 1;
+    }
+
+    sim.initial = app;
+
+    long long started_at = read_monotonic_us();
+
+    for (unsigned long i = 0; i < count; i++) {
+        sim_run(first_seed + i);
+    }
+
+    double elapsed = (double)(read_monotonic_us() - started_at) / 1e6;
+
+    printf("%lu scenarios in %.2f s (%.0f/s), %u violations\n",
+        count, elapsed, elapsed > 0 ? (double)count / elapsed : 0, sim.violations);
+
+    if (sim.settle_count > 0) {
+        qsort(sim.settle_ms, sim.settle_count, sizeof(sim.settle_ms[0]), compare_ms);
+
+        printf("settle time: p50 %lld ms, p90 %lld ms, p99 %lld ms, max %lld ms\n",
+            sim.settle_ms[sim.settle_count / 2], sim.settle_ms[sim.settle_count * 9 / 10],
+            sim.settle_ms[sim.settle_count * 99 / 100], sim.settle_ms[sim.settle_count - 1]);
+    }
+
+    return sim.violations ? 1 : 0;
+}
@@ -0,0 +1,502 @@
+/*
+ * xlatency - Local X11 proxy adding latency and bandwidth limits
+ *
+ * Copyright (C) 2024-2025 luke8086 <luke8086@fastmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>
+ */
+
+// Listens on the UNIX socket of one display and forwards every connection
+// to the socket of another one (usually Xvfb), delaying the data in both
+// directions by half of the round trip time and optionally limiting the
+// bandwidth, to simulate running clients over remote X.
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define X11_SOCKET_DIR "/tmp/.X11-unix"
+
+#define MAX_CONNECTIONS 64
+#define READ_SIZE 65536
+
+// Sides of a connection
+#define SIDE_CLIENT 0
+#define SIDE_SERVER 1
+
+// Data read from one side, waiting to be written to the other one
+struct chunk {
+    char *data;
+    long long deliver_at; // us
+    size_t len;
+    struct chunk *next;
+    size_t offset;
+};
+
+struct queue {
+    struct chunk *head;
+    long long link_free_at; // us, when the simulated link finishes sending
+    struct chunk *tail;
+};
+
+struct connection {
+    int active;
+    int eof[2];
+    int fds[2];
+    struct queue queues[2]; // indexed by the side the data was read from
+    int shut[2];
+};
+
+static struct {
+    long bandwidth; // bytes per second, 0 for unlimited
+    struct connection connections[MAX_CONNECTIONS];
+    int listen_fd;
+    char listen_path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+    long long one_way_us;
+    volatile sig_atomic_t quit;
+    char target_path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+} app = {
+    .listen_fd = -1,
+};
+
+static void close_connection(struct connection *);
+static int connect_target(void);
+static void exit_usage(int);
+static void flush_queue(struct connection *, int);
+static long long get_time_us(void);
+static void handle_accept(void);
+static void handle_read(struct connection *, int);
+static void handle_signal(int);
+static void listen_display(void);
+static int parse_display(const char *);
+static long parse_number(const char *, long, long);
+static void parse_opts(int, char *[]);
+static void run_proxy(void);
+static void set_nonblocking(int);
+
+static void
+exit_usage(int status)
+{
+    FILE *f = status ? stderr : stdout;
+
+    fprintf(f,
+        "xlatency [OPTIONS] LISTEN_DISPLAY TARGET_DISPLAY\n"
+        "\n"
+        "Options:\n"
+        "  -r RTT        Added round trip time in milliseconds (default: 0)\n"
+        "  -b BANDWIDTH  Bandwidth limit in KiB/s in each direction (default: unlimited)\n"
+        "  -h            Display this help message\n"
+        "\n"
+        "Example:\n"
+        "  Xvfb :1 & xlatency -r 20 :2 :1 & DISPLAY=:2 pmdock ...\n");
+
+    exit(status);
+}
+
+static long long
+get_time_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static long
+parse_number(const char *str, long min, long max)
+{
+    char *end;
+
+    errno = 0;
+    long ret = strtol(str, &end, 10);
+
+    if (errno || end == str || *end || ret < min || ret > max) {
+        errx(1, "Invalid number: %s", str);
+    }
+
+    return ret;
+}
+
+static int
+parse_display(const char *str)
+{
+    // Accept both ":1" and "1", screen numbers are irrelevant here
+    if (*str == ':') {
+        str++;
+    }
+
+    char buf[16];
+    snprintf(buf, sizeof(buf), "%.*s", (int)strcspn(str, "."), str);
+
+    return (int)parse_number(buf, 0, 65535);
+}
+
+static void
+parse_opts(int argc, char *argv[])
+{
+    int opt;
+
+    while ((opt = getopt(argc, argv, "b:hr:")) != -1) {
+        switch (opt) {
+        case 'b':
+            app.bandwidth = parse_number(optarg, 1, 1024 * 1024) * 1024;
+            break;
+        case 'h':
+            exit_usage(0);
+            break;
+        case 'r':
+            app.one_way_us = parse_number(optarg, 0, 60 * 1000) * 1000 / 2;
+            break;
+        default:
+            exit_usage(1);
+        }
+    }
+
+    if (argc - optind != 2) {
+        exit_usage(1);
+    }
+
+    int listen = parse_display(argv[optind]);
+    int target = parse_display(argv[optind + 1]);
+
+    if (listen == target) {
+        errx(1, "Listen and target displays must differ");
+    }
+
+    snprintf(app.listen_path, sizeof(app.listen_path), "%s/X%d", X11_SOCKET_DIR, listen);
+    snprintf(app.target_path, sizeof(app.target_path), "%s/X%d", X11_SOCKET_DIR, target);
+}
+
+static void
+set_nonblocking(int fd)
+{
+    int flags = fcntl(fd, F_GETFL);
+
+    if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+        err(1, "Failed to make socket non-blocking");
+    }
+}
+
+static void
+listen_display(void)
+{
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+
+    // The directory normally exists already when Xvfb is running
+    if (mkdir(X11_SOCKET_DIR, 01777) < 0 && errno != EEXIST) {
+        err(1, "Failed to create %s", X11_SOCKET_DIR);
+    }
+
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", app.listen_path);
+
+    app.listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+    if (app.listen_fd < 0) {
+        err(1, "Failed to create socket");
+    }
+
+    if (bind(app.listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        err(1, "Failed to bind %s", app.listen_path);
+    }
+
+    if (listen(app.listen_fd, 16) < 0) {
+        err(1, "Failed to listen on %s", app.listen_path);
+    }
+
+    set_nonblocking(app.listen_fd);
+}
+
+static int
+connect_target(void)
+{
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", app.target_path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+    if (fd < 0) {
+        return -1;
+    }
+
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    set_nonblocking(fd);
+
+    return fd;
+}
+
+static void
+handle_accept(void)
+{
+    int fd = accept(app.listen_fd, NULL, NULL);
+
+    if (fd < 0) {
+        return;
+    }
+
+    struct connection *conn = NULL;
+
+    for (int i = 0; i < MAX_CONNECTIONS && !conn; i++) {
+        if (!app.connections[i].active) {
+            conn = &app.connections[i];
+        }
+    }
+
+    if (!conn) {
+        warnx("Too many connections");
+        close(fd);
+        return;
+    }
+
+    int target_fd = connect_target();
+
+    if (target_fd < 0) {
+        warn("Failed to connect to %s", app.target_path);
+        close(fd);
+        return;
+    }
+
+    set_nonblocking(fd);
+
+    *conn = (struct connection) {
+        .active = 1,
+        .fds = { fd, target_fd },
+    };
+}
+
+static void
+close_connection(struct connection *conn)
+{
+    for (int side = 0; side < 2; side++) {
+        close(conn->fds[side]);
+
+        while (conn->queues[side].head) {
+            struct chunk *chunk = conn->queues[side].head;
+            conn->queues[side].head = chunk->next;
+            free(chunk->data);
+            free(chunk);
+        }
+    }
+
+    *conn = (struct connection) { 0 };
+}
+
+static void
+handle_read(struct connection *conn, int side)
+{
+    char buf[READ_SIZE];
+    ssize_t len = read(conn->fds[side], buf, sizeof(buf));
+
+    if (len < 0 && (errno == EAGAIN || errno == EINTR)) {
+        return;
+    }
+
+    if (len <= 0) {
+        // Half-close the other side once the queued data is delivered
+        conn->eof[side] = 1;
+        return;
+    }
+
+    struct queue *queue = &conn->queues[side];
+    struct chunk *chunk = calloc(1, sizeof(struct chunk));
+    long long now = get_time_us();
+
+    if (!chunk || !(chunk->data = malloc((size_t)len))) {
+        err(1, "Failed to allocate memory");
+    }
+
+    memcpy(chunk->data, buf, (size_t)len);
+    chunk->len = (size_t)len;
+
+    // Data leaves the simulated link in order, after the previous chunk
+    if (queue->link_free_at < now) {
+        queue->link_free_at = now;
+    }
+
+    if (app.bandwidth) {
+        queue->link_free_at += (long long)len * 1000000 / app.bandwidth;
+    }
+
+    chunk->deliver_at = queue->link_free_at + app.one_way_us;
+
+    if (queue->tail) {
+        queue->tail->next = chunk;
+    } else {
+        queue->head = chunk;
+    }
+
+    queue->tail = chunk;
+}
+
+static void
+flush_queue(struct connection *conn, int side)
+{
+    struct queue *queue = &conn->queues[side];
+    int fd = conn->fds[!side];
+    long long now = get_time_us();
+
+    while (queue->head && queue->head->deliver_at <= now) {
+        struct chunk *chunk = queue->head;
+        ssize_t len = write(fd, chunk->data + chunk->offset, chunk->len - chunk->offset);
+
+        if (len < 0 && (errno == EAGAIN || errno == EINTR)) {
+            return;
+        }
+
+        if (len < 0) {
+            // The receiving side is gone, nothing more can be delivered
+            conn->eof[0] = conn->eof[1] = 1;
+            conn->shut[0] = conn->shut[1] = 1;
+            return;
+        }
+
+        chunk->offset += (size_t)len;
+
+        if (chunk->offset < chunk->len) {
+            return;
+        }
+
+        queue->head = chunk->next;
+
+        if (!queue->head) {
+            queue->tail = NULL;
+        }
+
+        free(chunk->data);
+        free(chunk);
+    }
+
+    if (conn->eof[side] && !queue->head && !conn->shut[side]) {
+        shutdown(fd, SHUT_WR);
+        conn->shut[side] = 1;
+    }
+}
+
+static void
+handle_signal(int sig)
+{
+    (void)sig;
+    app.quit = 1;
+}
+
+static void
+run_proxy(void)
+{
+    // One slot for the listening socket, two for each connection
+    struct pollfd fds[1 + MAX_CONNECTIONS * 2];
+
+    while (!app.quit) {
+        long long now = get_time_us();
+        long long next = -1;
+
+        fds[0] = (struct pollfd) { .fd = app.listen_fd, .events = POLLIN };
+
+        for (int i = 0; i < MAX_CONNECTIONS; i++) {
+            struct connection *conn = &app.connections[i];
+
+            for (int side = 0; side < 2; side++) {
+                struct pollfd *pfd = &fds[1 + i * 2 + side];
+                struct chunk *due = conn->queues[!side].head;
+
+                *pfd = (struct pollfd) { .fd = -1 };
+
+                if (!conn->active) {
+                    continue;
+                }
+
+                if (!conn->eof[side]) {
+                    pfd->events |= POLLIN;
+                }
+
+                if (due && due->deliver_at <= now) {
+                    pfd->events |= POLLOUT;
+                } else if (due && (next < 0 || due->deliver_at < next)) {
+                    next = due->deliver_at;
+                }
+
+                // A closed socket would keep reporting POLLHUP otherwise
+                if (pfd->events) {
+                    pfd->fd = conn->fds[side];
+                }
+            }
+        }
+
+        int timeout = next < 0 ? -1 : (int)((next - now + 999) / 1000);
+
+        if (poll(fds, 1 + MAX_CONNECTIONS * 2, timeout) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            err(1, "Failed to poll");
+        }
+
+        if (fds[0].revents & POLLIN) {
+            handle_accept();
+        }
+
+        for (int i = 0; i < MAX_CONNECTIONS; i++) {
+            struct connection *conn = &app.connections[i];
+
+            if (!conn->active) {
+                continue;
+            }
+
+            for (int side = 0; side < 2; side++) {
+                if (fds[1 + i * 2 + side].revents & (POLLIN | POLLHUP | POLLERR)) {
+                    handle_read(conn, side);
+                }
+            }
+
+            flush_queue(conn, SIDE_CLIENT);
+            flush_queue(conn, SIDE_SERVER);
+
+            if (conn->shut[SIDE_CLIENT] && conn->shut[SIDE_SERVER]) {
+                close_connection(conn);
+            }
+        }
+    }
+}
+
+int
+main(int argc, char *argv[])
+{
+    parse_opts(argc, argv);
+
+    signal(SIGINT, handle_signal);
+    signal(SIGTERM, handle_signal);
+    signal(SIGPIPE, SIG_IGN);
+
+    listen_display();
+    run_proxy();
+
+    unlink(app.listen_path);
+
+    return 0;
+}